@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bench.c: device exchange benchmark
+ *
+ * Measures back-to-back USBIO2_RW round trips, which bound every mode
+ * that reads pins: the sample rate of count/freq, the slot rate of scan.
+ * From the measured intervals it derives the sampling limits:
+ *   - highest input frequency that can be counted (Nyquist, rate / 2)
+ *   - shortest pulse that is always seen (the longest sample interval)
+ *   - period resolution (the mean sample interval)
+ */
+
+#include <err.h>	/* err() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), qsort() */
+
+#include "usbio.h"
+
+#define BENCH_DEFAULT_COUNT	1000
+
+static int
+bench_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * bench mode
+ *   -n: number of exchanges per device
+ *   with several devices (-f ..., -a), a round sends one request to every
+ *   device before reading the replies, as a writer fanning out would
+ */
+int
+bench_main(int fd, int argc, char *argv[]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	unsigned char *seq;
+	uint64_t *rtt, *sent, t, start, sum = 0;
+	double rate;
+	int d, i, n, total;
+
+	n = opts.count > 0 ? opts.count : BENCH_DEFAULT_COUNT;
+	rtt = calloc((size_t)n * ndevs, sizeof(*rtt));
+	sent = calloc(ndevs, sizeof(*sent));
+	seq = calloc(ndevs, sizeof(*seq));
+	if (rtt == NULL || sent == NULL || seq == NULL)
+		err(1, "calloc");
+
+	/* the first exchange may include device wake up, not counted */
+	for (d = 0; d < ndevs; d++) {
+		usbio_frame2(buf, 0, 0, 0);
+		usbio_xfer2(devs[d].fd, buf);
+	}
+
+	total = 0;
+	start = usbio_nsec();
+	for (i = 0; i < n && !interrupted; i++) {
+		for (d = 0; d < ndevs; d++) {
+			usbio_frame2(buf, 0, 0, 0);
+			seq[d] = buf[USBIO_SEQNO] = seqno++;
+			sent[d] = usbio_nsec();
+			usbio_send2(devs[d].fd, buf);
+		}
+		for (d = 0; d < ndevs; d++) {
+			if (usbio_read2(devs[d].fd, seq[d], buf) == -1)
+				goto out;
+			t = usbio_nsec() - sent[d];
+			rtt[total++] = t;
+			sum += t;
+		}
+	}
+out:
+	t = usbio_nsec() - start;
+	if (total == 0) {
+		free(rtt);
+		free(sent);
+		free(seq);
+		return 1;
+	}
+	qsort(rtt, total, sizeof(*rtt), bench_cmp);
+	rate = total * 1e9 / t;
+
+	printf("devices %d, exchanges %d in %.3f s, %.1f exchanges/s\n",
+		ndevs, total, t / 1e9, rate);
+	printf("rtt us: min %llu avg %llu p50 %llu p99 %llu max %llu\n",
+		(unsigned long long)rtt[0] / 1000,
+		(unsigned long long)sum / total / 1000,
+		(unsigned long long)rtt[total / 2] / 1000,
+		(unsigned long long)rtt[total * 99 / 100] / 1000,
+		(unsigned long long)rtt[total - 1] / 1000);
+	/* per device, one sample per round */
+	rate /= ndevs;
+	printf("sampling limits: max input %.1f Hz,"
+		" min pulse width %.3f ms, period resolution %.3f ms\n",
+		rate / 2, rtt[total - 1] / 1e6, 1e3 / rate);
+
+	free(rtt);
+	free(sent);
+	free(seq);
+	return 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# capmerge.sh: merge of many captures into one timeline
+#
+# Generates one synthetic capture per host with usbiocap -g, all started
+# at the same time but each on the monotonic clock of a host up for a
+# different time, merges them with usbiocap -M and reports the rate of
+# the merge and the memory it used.  With the defaults, 64 hosts of 16
+# devices with a change every 10 ms, each capture covers about 7 hours.
+#
+# usage: capmerge.sh [-c captures] [-D devices] [-i interval_us]
+#	[-n records] [-u usbiocap] [dir]
+# e.g.   capmerge.sh -c 128 -D 8 /var/tmp/caps
+#
+
+captures=64
+devices=16
+interval=10000
+records=2500000
+usbiocap=${USBIOCAP:-usbiocap}
+
+while getopts c:D:i:n:u: ch; do
+	case $ch in
+	c)	captures=$OPTARG ;;
+	D)	devices=$OPTARG ;;
+	i)	interval=$OPTARG ;;
+	n)	records=$OPTARG ;;
+	u)	usbiocap=$OPTARG ;;
+	*)	echo "usage: $0 [-c captures] [-D devices] [-i interval_us]" \
+		    "[-n records] [-u usbiocap] [dir]" >&2
+		exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -gt 0 ]; then
+	dir=$1
+	mkdir -p "$dir" || exit 1
+else
+	dir=$(mktemp -d) || exit 1
+	trap 'rm -rf "$dir"' EXIT
+fi
+
+start=$(date +%s)
+i=0
+while [ $i -lt $captures ]; do
+	[ -f "$dir/host$i.cap" ] || "$usbiocap" -g -D $devices -i $interval \
+	    -n $records -t $start "$dir/host$i.cap" > /dev/null || exit 1
+	i=$((i + 1))
+done
+du -sh "$dir"
+
+"$usbiocap" -M "$dir/merged.cap" "$dir"/host*.cap | tail -1
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# capquery.sh: time-range queries over a large capture
+#
+# Generates a synthetic capture with usbiocap -g (many hours of 16
+# devices, pins 1.0-1.3 changing in rare events, the other pins all the
+# time), then runs the same random windows with usbiocap -B once for
+# pins 1.0-1.3, where the block summaries let most blocks be skipped,
+# and once for all pins, where every block in the window is read.
+#
+# usage: capquery.sh [-n records] [-q queries] [-w window_s]
+#	[-u usbiocap] [capfile]
+# e.g.   capquery.sh -n 100000000 /var/tmp/big.cap
+#
+
+records=20000000
+queries=1000
+window=180
+usbiocap=${USBIOCAP:-usbiocap}
+
+while getopts n:q:u:w: ch; do
+	case $ch in
+	n)	records=$OPTARG ;;
+	q)	queries=$OPTARG ;;
+	u)	usbiocap=$OPTARG ;;
+	w)	window=$OPTARG ;;
+	*)	echo "usage: $0 [-n records] [-q queries] [-w window_s]" \
+		    "[-u usbiocap] [capfile]" >&2
+		exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -gt 0 ]; then
+	cap=$1
+else
+	tmp=$(mktemp -d) || exit 1
+	trap 'rm -rf "$tmp"' EXIT
+	cap=$tmp/capquery.cap
+fi
+
+[ -f "$cap" ] || "$usbiocap" -g -n $records "$cap" || exit 1
+ls -l "$cap"
+
+echo "pins 1.0-1.3:"
+"$usbiocap" -B $queries -w $window -p 1.0-1.3 "$cap" || exit 1
+echo "all pins:"
+"$usbiocap" -B $queries -w $window "$cap"
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+#
+# coldstart.sh: exec-to-report time of a one-shot usbioctl run
+#
+# Runs "usbioctl [args] value" under ktrace(1) n times and reports, from
+# the kdump(1) timestamps, the time from execve(2) to the write(2) of the
+# report, the number of system calls made before it and in total, and
+# the mmap(2) calls before it; link with LDSTATIC=-static to leave out
+# those of ld.so, then any left are heap allocations.
+# A first run with -i "" fills the device index, see ident.c, and is not
+# counted; the runs measured only read it.
+#
+# usage: coldstart.sh [-n runs] [-t target_us] [-s target_calls]
+#	[-u usbioctl] [-- usbioctl args]
+# e.g.   coldstart.sh -n 50 -- -D /tmp/sim
+#
+
+runs=20
+target_us=1000		# exec to report on the wire
+target_calls=40		# system calls before the report
+usbioctl=${USBIOCTL:-usbioctl}
+
+while getopts n:s:t:u: ch; do
+	case $ch in
+	n)	runs=$OPTARG ;;
+	s)	target_calls=$OPTARG ;;
+	t)	target_us=$OPTARG ;;
+	u)	usbioctl=$OPTARG ;;
+	*)	echo "usage: $0 [-n runs] [-t target_us] [-s target_calls]" \
+		    "[-u usbioctl] [-- usbioctl args]" >&2
+		exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+"$usbioctl" -i "" "$@" 00 || exit 1	# fill the index
+
+i=0
+while [ $i -lt $runs ]; do
+	rm -f "$tmp/ktrace.out"
+	ktrace -f "$tmp/ktrace.out" -t c "$usbioctl" "$@" 00 || exit 1
+	# the execve(2) returns, then the first write(2) of 64 bytes is the
+	# report: everything before it goes into the cold start
+	kdump -T -f "$tmp/ktrace.out" | awk '
+		$4 == "RET" && $5 ~ /^execve/ && t0 == "" { t0 = $3; next }
+		t0 == "" { next }
+		$4 == "CALL" {
+			n++
+			if ($5 ~ /^(mmap|brk|sbrk)\(/ && !sent)
+				heap++
+			if ($5 ~ /^write\(/ && $5 ~ /,0x40\)$/ && !sent) {
+				sent = 1; calls = n; t1 = $3
+			}
+		}
+		END {
+			printf "%.0f %d %d %d\n", (t1 - t0) * 1e6, calls, n,
+			    heap
+		}' >> "$tmp/runs"
+	i=$((i + 1))
+done
+
+sort -n "$tmp/runs" | awk -v target_us=$target_us \
+    -v target_calls=$target_calls '
+	{ us[NR] = $1; calls = $2; total = $3; heap += $4 }
+	END {
+		p50 = us[int((NR + 1) / 2)]
+		printf "runs %d: exec to report us: min %d p50 %d max %d" \
+		    " (target %d)\n", NR, us[1], p50, us[NR], target_us
+		printf "system calls: %d before the report, %d in total" \
+		    " (target %d)\n", calls, total, target_calls
+		printf "mmap calls before the report: %d\n", heap / NR
+		exit !(p50 <= target_us && calls <= target_calls)
+	}'
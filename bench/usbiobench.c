@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usbiobench: microbenchmarks of the building blocks of usbioctl
+ *
+ * Times the primitives under the per report cost, without a device:
+ *	frame	building a request, usbio_frame2() (the memset and fill
+ *		usbio_write2() does inline)
+ *	reply	matching a reply by its sequence number and taking its
+ *		pins, as -m monitor does (input_match(), input_sample())
+ *	value	parsing a command line value, usbio_value()
+ *	queue	linking a sequence into the run queue of serve mode by
+ *		priority and unlinking the head (serve_link/unlink())
+ *	wheel	adding a lease to the timer wheel of watchdog mode and
+ *		expiring it (wd_lease(), wd_run())
+ *	merge	merging pins into the output shadow of a device and
+ *		marking it dirty (wd_set())
+ *	nsec	a timestamp, usbio_nsec(), see clock.c
+ *
+ * The static functions are reached by building input.c, serve.c and
+ * watchdog.c into this file, so what is timed is the code usbioctl runs.
+ *
+ * Each benchmark is run for the warmup time, then for reps rounds of
+ * about the round time; a line per benchmark gives the operations of a
+ * round and the ns per operation of the median, fastest and slowest
+ * rounds, tab separated, after a "#" line naming the columns.  With -c,
+ * the process is pinned to a CPU where the system can do so.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE		/* CPU_SET() */
+#endif
+
+#include <sys/types.h>
+#if defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <err.h>	/* err() */
+#include <stdio.h>
+#include <stdlib.h>	/* atoi(), qsort() */
+#include <string.h>	/* strcmp() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* getopt() */
+
+#include "usbio.h"
+
+/* the modes whose static primitives are timed */
+#include "input.c"
+#include "serve.c"
+#include "watchdog.c"
+
+#define MB_REPS		11
+#define MB_ROUND_MS	20
+#define MB_WARMUP_MS	200
+#define MB_MAXREPS	101
+
+/* what usbioctl.c defines */
+struct usbio_opts opts;
+struct usbio_dev devs[USBIO_MAXDEVS];
+int ndevs = 0;
+volatile sig_atomic_t interrupted = 0;
+
+struct mb {
+	const char	*name;
+	void		(*init)(void);
+	uint64_t	(*run)(uint64_t);	/* n rounds, return ops */
+};
+
+static volatile uint64_t mb_sink;
+
+/* prototypes */
+void	usage(void);
+
+static uint64_t
+mb_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+mb_frame(uint64_t n) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2, i, i >> 8);
+		mb_sink += buf[2];
+	}
+	return n;
+}
+
+static struct input_dev mb_in;
+static unsigned char mb_reply[USBIO_REPORT_SIZE];
+
+static void
+mb_reply_init(void) {
+	memset(&mb_in, 0, sizeof(mb_in));
+	memset(mb_reply, 0, sizeof(mb_reply));
+	mb_reply[0] = USBIO2_RW;
+	mb_reply[USBIO_REPLY_PORT1] = 0x5a;
+	mb_reply[USBIO_REPLY_PORT2] = 0x03;
+	mb_in.known = 1;
+	mb_in.pins = 0x35a;	/* no change, nothing printed */
+	mb_in.interval = INPUT_SLOW_MS * 1000000ULL;
+}
+
+static uint64_t
+mb_reply_run(uint64_t n) {
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		mb_in.busy = 1;
+		mb_in.seq = i;
+		mb_reply[USBIO_SEQNO] = i;
+		if (mb_in.busy && input_match(mb_reply, mb_in.seq))
+			input_sample(&mb_in, 0, mb_reply, i, 0,
+				INPUT_SLOW_MS * 1000000ULL);
+	}
+	mb_sink += mb_in.samples;
+	return n;
+}
+
+static uint64_t
+mb_value(uint64_t n) {
+	static const char *vals[] = { "0", "5a", "ff", "0x3c", "100", "7" };
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		mb_sink += usbio_value(vals[i % 6]);
+	return n;
+}
+
+static uint64_t
+mb_queue(uint64_t n) {
+	uint64_t i;
+	int j;
+
+	for (j = 0; j < SERVE_MAXSEQ; j++)
+		serve_seqs[j].prio = (j * 7) % 5;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < SERVE_MAXSEQ; j++)
+			serve_link(&serve_seqs[j]);
+		while (serve_head != NULL)
+			serve_unlink(serve_head);
+	}
+	return n * SERVE_MAXSEQ * 2;
+}
+
+static void
+mb_wheel_init(void) {
+	int i;
+
+	ndevs = 1;
+	for (i = 0; i < WD_SLOTS; i++)
+		wd_wheel[i] = -1;
+	wd_nfree = 0;
+	for (i = USBIO_WD_MAXLEASES - 1; i >= 0; i--)
+		wd_free[wd_nfree++] = i;
+}
+
+static uint64_t
+mb_wheel_run(uint64_t n) {
+	static const char *specs[] = { "1=01/01@20", "2=02/02@50",
+		"1=04/04@100", "1=80/80@3000" };	/* the last one laps */
+	uint64_t i;
+	int j, k, nl = USBIO_WD_MAXLEASES / 2;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < nl; j++)
+			if (wd_lease(specs[j % 4]) == -1)
+				errx(1, "wheel: lease");
+		/* nobody renews: every lease expires within 300 ticks */
+		for (k = 0; k < 300 + 1; k++) {
+			wd_tick++;
+			wd_run(0);
+		}
+		wd_dirty[0] = 0;
+		wd_ndirty = 0;
+	}
+	return n * nl;
+}
+
+static uint64_t
+mb_merge(uint64_t n) {
+	uint64_t i;
+	int d;
+
+	for (i = 0; i < n; i++) {
+		d = i % 64;
+		wd_set(d, i & 1, i, 0x0f << (i & 4));
+		if (wd_ndirty == 64) {
+			for (d = 0; d < wd_ndirty; d++)
+				wd_dirty[wd_dirtylist[d]] = 0;
+			wd_ndirty = 0;
+		}
+	}
+	mb_sink += devs[0].out[0];
+	return n;
+}
+
+static uint64_t
+mb_clock(uint64_t n) {
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		mb_sink += usbio_nsec();
+	return n;
+}
+
+static struct mb mbs[] = {
+	{ "frame",	NULL,		mb_frame },
+	{ "reply",	mb_reply_init,	mb_reply_run },
+	{ "value",	NULL,		mb_value },
+	{ "queue",	NULL,		mb_queue },
+	{ "wheel",	mb_wheel_init,	mb_wheel_run },
+	{ "merge",	NULL,		mb_merge },
+	{ "nsec",	NULL,		mb_clock },
+};
+
+/*
+ * pin the process to cpu
+ *   return -1 if it can not be done here
+ */
+static int
+mb_pin(int cpu) {
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+#elif defined(__FreeBSD__)
+	cpuset_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+		sizeof(set), &set);
+#else
+	return -1;	/* left to the scheduler */
+#endif
+}
+
+static int
+dblcmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * run one benchmark: warm up, size a round, time the rounds
+ */
+static void
+mb_run(const struct mb *m, int reps, uint64_t round, uint64_t warmup) {
+	double ns[MB_MAXREPS];
+	uint64_t n = 1, ops = 0, t0, t;
+	int r;
+
+	if (m->init != NULL)
+		m->init();
+	t0 = mb_nsec();
+	do {
+		t = mb_nsec();
+		ops = m->run(n);
+		t = mb_nsec() - t;
+		if (t < round)
+			n *= 2;
+	} while (mb_nsec() - t0 < warmup || t < round / 2);
+
+	for (r = 0; r < reps; r++) {
+		t = mb_nsec();
+		ops = m->run(n);
+		ns[r] = (double)(mb_nsec() - t) / ops;
+	}
+	qsort(ns, reps, sizeof(ns[0]), dblcmp);
+	printf("%s\t%llu\t%.2f\t%.2f\t%.2f\n", m->name,
+		(unsigned long long)ops, ns[reps / 2], ns[0], ns[reps - 1]);
+	fflush(stdout);
+}
+
+/*
+ * main
+ */
+int
+main(int argc, char *argv[]) {
+	uint64_t round = MB_ROUND_MS, warmup = MB_WARMUP_MS;
+	int ch, i, j, cpu = -1, pinned = 0, reps = MB_REPS;
+
+	while ((ch = getopt(argc, argv, "c:r:t:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			if (reps < 1 || reps > MB_MAXREPS)
+				usage();	/* not return */
+			break;
+		case 't':
+			round = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			warmup = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	for (i = 0; i < argc; i++) {
+		for (j = 0; j < sizeof(mbs) / sizeof(mbs[0]); j++)
+			if (strcmp(argv[i], mbs[j].name) == 0)
+				break;
+		if (j == sizeof(mbs) / sizeof(mbs[0]))
+			usage();	/* not return */
+	}
+
+	if (cpu >= 0) {
+		pinned = mb_pin(cpu) == 0;
+		if (!pinned)
+			warnx("can not pin to cpu %d here, not pinned", cpu);
+	}
+	printf("# usbiobench: %d rounds of %llu ms after %llu ms warmup,"
+		" cpu %s\n", reps, (unsigned long long)round,
+		(unsigned long long)warmup, pinned ? "pinned" : "not pinned");
+	printf("# name\tops/round\tns/op p50\tmin\tmax\n");
+	for (j = 0; j < sizeof(mbs) / sizeof(mbs[0]); j++) {
+		for (i = 0; i < argc; i++)
+			if (strcmp(argv[i], mbs[j].name) == 0)
+				break;
+		if (argc == 0 || i < argc)
+			mb_run(&mbs[j], reps, round * 1000000ULL,
+				warmup * 1000000ULL);
+	}
+	return 0;
+}
+
+__dead void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-c cpu] [-r reps] [-t round_ms]"
+		" [-w warmup_ms] [benchmark ...]\n", getprogname());
+	fprintf(stderr, "	benchmarks: frame reply value queue wheel merge"
+		" nsec\n");
+	exit(2);
+}
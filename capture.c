@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * capture.c: input capture files, shared with usbiocap
+ *
+ * After the header, records are stored in blocks of USBIO_CAP_BLOCK
+ * bytes (the last one may be short).  A block starts with a summary: the
+ * time of its first and last record, the pins changed by any of its
+ * records, and the pins of every device when it starts.  Blocks have a
+ * fixed size, so block k is found without an index; their times only
+ * grow, so the block of a time is found by a binary search over the
+ * summaries.  A reader looking at some pins in a time range touches the
+ * pages of the summaries it searches and of the blocks where those pins
+ * changed, nothing else.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>	/* err() */
+#include <fcntl.h>	/* open() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), free() */
+#include <string.h>	/* memcpy(), memset() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* close() */
+
+#include "usbio.h"
+
+#define CAP_RECOFF(ndevs) \
+	((sizeof(struct usbio_cap_blk) + (ndevs) * sizeof(uint16_t) + 15) & ~15)
+
+/*
+ * create a capture file, t0 is the monotonic time of its start and
+ * t0_real the CLOCK_REALTIME then, 0 for now
+ */
+struct usbio_capw *
+cap_create(const char *path, int ndevs, uint64_t t0, uint64_t t0_real) {
+	struct usbio_capw *cw;
+	struct usbio_cap_hdr h;
+	struct timespec ts;
+
+	if (ndevs < 1 || CAP_RECOFF(ndevs) + sizeof(struct usbio_cap_rec) >
+	    USBIO_CAP_BLOCK)
+		errx(1, "%s: %d devices do not fit a block", path, ndevs);
+	if ((cw = calloc(1, sizeof(*cw))) == NULL ||
+	    (cw->blk = calloc(1, USBIO_CAP_BLOCK)) == NULL ||
+	    (cw->state = calloc(ndevs, sizeof(*cw->state))) == NULL)
+		err(1, "calloc");
+	if ((cw->fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	cw->path = path;
+	cw->ndevs = ndevs;
+	cw->recoff = CAP_RECOFF(ndevs);
+	cw->maxrecs = (USBIO_CAP_BLOCK - cw->recoff) /
+		sizeof(struct usbio_cap_rec);
+
+	if (t0_real == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		t0_real = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	memset(&h, 0, sizeof(h));
+	h.magic = USBIO_CAP_MAGIC;
+	h.version = USBIO_CAP_VERSION;
+	h.ndevs = ndevs;
+	h.blksize = USBIO_CAP_BLOCK;
+	h.t0 = t0;
+	h.t0_real = t0_real;
+	if (fwrite(&h, sizeof(h), 1, cw->fp) != 1)
+		err(1, "%s", path);
+	return cw;
+}
+
+static void
+cap_flush(struct usbio_capw *cw) {
+	struct usbio_cap_blk *b = (struct usbio_cap_blk *)cw->blk;
+	size_t len;
+
+	if (cw->nrecs == 0)
+		return;
+	b->nrecs = cw->nrecs;
+	/* only the last block is short */
+	len = cw->nrecs == cw->maxrecs ? USBIO_CAP_BLOCK :
+		cw->recoff + cw->nrecs * sizeof(struct usbio_cap_rec);
+	if (fwrite(cw->blk, len, 1, cw->fp) != 1)
+		err(1, "%s", cw->path);
+	cw->nrecs = 0;
+}
+
+/*
+ * append a record, records come in time order
+ */
+void
+cap_write(struct usbio_capw *cw, const struct usbio_cap_rec *rec) {
+	struct usbio_cap_blk *b = (struct usbio_cap_blk *)cw->blk;
+
+	if (cw->nrecs == 0) {
+		memset(b, 0, cw->recoff);
+		b->magic = USBIO_CAP_BLK_MAGIC;
+		b->ndevs = cw->ndevs;
+		b->t_first = rec->t;
+		memcpy(b->state, cw->state, cw->ndevs * sizeof(*cw->state));
+	}
+	memcpy(cw->blk + cw->recoff + cw->nrecs * sizeof(*rec), rec,
+		sizeof(*rec));
+	b->t_last = rec->t;
+	b->changed |= rec->changed;
+	if (rec->dev < cw->ndevs)
+		cw->state[rec->dev] = rec->pins | USBIO_CAP_KNOWN;
+	if (++cw->nrecs == cw->maxrecs)
+		cap_flush(cw);
+}
+
+int
+cap_close(struct usbio_capw *cw) {
+	int ret;
+
+	cap_flush(cw);
+	ret = fclose(cw->fp) == EOF ? -1 : 0;
+	free(cw->blk);
+	free(cw->state);
+	free(cw);
+	return ret;
+}
+
+/*
+ * map a capture file for reading
+ *   return -1 on error, after telling why
+ */
+int
+cap_map(const char *path, struct usbio_capr *cr) {
+	struct stat st;
+	int fd;
+
+	memset(cr, 0, sizeof(*cr));
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		warn("%s", path);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(struct usbio_cap_hdr)) {
+		close(fd);
+		warnx("%s: not a capture", path);
+		return -1;
+	}
+	cr->size = st.st_size;
+	cr->base = mmap(NULL, cr->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cr->base == MAP_FAILED) {
+		warn("mmap");
+		return -1;
+	}
+	cr->hdr = (const struct usbio_cap_hdr *)cr->base;
+	if (cr->hdr->magic != USBIO_CAP_MAGIC ||
+	    cr->hdr->version != USBIO_CAP_VERSION ||
+	    cr->hdr->blksize != USBIO_CAP_BLOCK || cr->hdr->ndevs < 1) {
+		warnx("%s: not a capture of this version", path);
+		munmap((void *)cr->base, cr->size);
+		return -1;
+	}
+	cr->recoff = CAP_RECOFF(cr->hdr->ndevs);
+	cr->nblocks = (cr->size - sizeof(struct usbio_cap_hdr) +
+		USBIO_CAP_BLOCK - 1) / USBIO_CAP_BLOCK;
+	/* a block cut short by a crash */
+	if (cr->nblocks > 0 && cap_nrecs(cr, cr->nblocks - 1) == 0)
+		cr->nblocks--;
+	return 0;
+}
+
+void
+cap_unmap(struct usbio_capr *cr) {
+	munmap((void *)cr->base, cr->size);
+}
+
+const struct usbio_cap_blk *
+cap_block(const struct usbio_capr *cr, uint32_t k) {
+	return (const struct usbio_cap_blk *)(cr->base +
+		sizeof(struct usbio_cap_hdr) + (size_t)k * USBIO_CAP_BLOCK);
+}
+
+const struct usbio_cap_rec *
+cap_recs(const struct usbio_capr *cr, uint32_t k) {
+	return (const struct usbio_cap_rec *)((const unsigned char *)
+		cap_block(cr, k) + cr->recoff);
+}
+
+/*
+ * the number of records of block k, as far as they are in the file
+ */
+uint32_t
+cap_nrecs(const struct usbio_capr *cr, uint32_t k) {
+	size_t off = sizeof(struct usbio_cap_hdr) +
+		(size_t)k * USBIO_CAP_BLOCK;
+	size_t avail;
+
+	if (off + cr->recoff > cr->size ||
+	    cap_block(cr, k)->magic != USBIO_CAP_BLK_MAGIC)
+		return 0;
+	avail = (cr->size - off - cr->recoff) / sizeof(struct usbio_cap_rec);
+	return cap_block(cr, k)->nrecs < avail ? cap_block(cr, k)->nrecs :
+		avail;
+}
+
+/*
+ * the first block with a record at or after t, nblocks if none
+ */
+uint32_t
+cap_find(const struct usbio_capr *cr, uint64_t t) {
+	uint32_t lo = 0, hi = cr->nblocks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cap_block(cr, mid)->t_last < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * check.c: static timing feasibility check of a sequence
+ *
+ * A sequence is played one acknowledged report at a time, so a step can
+ * not start before the previous exchange has completed.  Using the
+ * device's latency profile (-P, fitted by usbiosim -F from a trace of the
+ * real board) the achievable time of every step is estimated twice: with
+ * median latencies and with the worst observed ones.  Steps which can
+ * not start on time are reported.  No device is opened.
+ */
+
+#include <err.h>	/* err() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), exit() */
+#include <string.h>	/* memset() */
+
+#include "usbio.h"
+
+#define CHECK_MEDIAN	5	/* decile index of the median */
+#define CHECK_WORST	(USBIO_PROFILE_QUANTILES - 1)
+
+/*
+ * without a profile, assume a full speed interrupt pipe with 1 ms frames,
+ * one frame for the request and one for the reply
+ */
+static void
+check_default_profile(struct usbio_profile *prof) {
+	int i;
+
+	memset(prof, 0, sizeof(*prof));
+	prof->idle = 1000000000ULL;
+	for (i = 0; i < USBIO_PROFILE_QUANTILES; i++) {
+		prof->rtt[i] = 2000000 + i * 100000;
+		prof->first[i] = prof->rtt[i] + 1000000;
+		prof->burst[i] = 1000000 + i * 100000;
+	}
+}
+
+/*
+ * estimate when each step completes, with the given decile
+ *   late: how much later than requested the step was sent, per step
+ *   return the number of steps that could not start on time
+ */
+static int
+check_run(struct seq *sq, struct usbio_profile *prof, int q, uint64_t *late) {
+	uint64_t done = 0, start, lat, last[USBIO_MAXDEVS];
+	int i, n = 0;
+
+	memset(last, 0, sizeof(last));
+	for (i = 0; i < sq->n; i++) {
+		struct seq_step *st = &sq->step[i];
+
+		start = st->t > done ? st->t : done;
+		if (last[st->dev] == 0 || start - last[st->dev] > prof->idle)
+			lat = prof->first[q];
+		else
+			lat = prof->rtt[q];
+		done = start + lat;
+		last[st->dev] = done;
+		late[i] = start - st->t;
+		if (late[i] > 0)
+			n++;
+	}
+	return n;
+}
+
+/*
+ * check mode
+ *   the sequence comes from -s or the command line, -O optimizes it first
+ */
+int
+check_main(int fd, int argc, char *argv[]) {
+	struct usbio_profile prof;
+	struct seq sq;
+	uint64_t *typ, *worst, gap, min_gap = 0, max_typ = 0, max_worst = 0;
+	int i, n_typ, n_worst, min_at = -1;
+
+	if (opts.profile != NULL) {
+		if (profile_load(opts.profile, &prof) == -1)
+			errx(1, "%s: bad profile", opts.profile);
+	} else {
+		check_default_profile(&prof);
+		printf("no profile given, assuming 1 ms frames\n");
+	}
+
+	memset(&sq, 0, sizeof(sq));
+	if (opts.seqfile != NULL) {
+		if (seq_compile_file(&sq, opts.seqfile) == -1)
+			exit(1);
+	} else
+		seq_compile_args(&sq, opts.port, argc, argv);
+	seq_sort(&sq);
+	if (opts.tolerance >= 0)
+		seq_optimize(&sq, opts.tolerance * 1000000ULL);
+	if (sq.n == 0) {
+		printf("empty sequence\n");
+		return 0;
+	}
+
+	typ = calloc(sq.n, sizeof(*typ));
+	worst = calloc(sq.n, sizeof(*worst));
+	if (typ == NULL || worst == NULL)
+		err(1, "calloc");
+	n_typ = check_run(&sq, &prof, CHECK_MEDIAN, typ);
+	n_worst = check_run(&sq, &prof, CHECK_WORST, worst);
+
+	for (i = 0; i < sq.n; i++) {
+		if (i > 0) {
+			gap = sq.step[i].t - sq.step[i - 1].t;
+			if (min_at == -1 || gap < min_gap) {
+				min_gap = gap;
+				min_at = i;
+			}
+		}
+		if (typ[i] > max_typ)
+			max_typ = typ[i];
+		if (worst[i] > max_worst)
+			max_worst = worst[i];
+		if (worst[i] == 0)
+			continue;
+		printf("step %d: at %.3f ms, late %.3f ms (worst %.3f ms)%s\n",
+			sq.step[i].line, sq.step[i].t / 1e6, typ[i] / 1e6,
+			worst[i] / 1e6, typ[i] ? "" : ", only at worst case");
+	}
+
+	printf("device: min report interval %.3f ms (rtt median),"
+		" %.3f ms worst, first write %.3f ms\n",
+		prof.rtt[CHECK_MEDIAN] / 1e6, prof.rtt[CHECK_WORST] / 1e6,
+		prof.first[CHECK_MEDIAN] / 1e6);
+	if (min_at != -1)
+		printf("sequence: %d steps, shortest interval %.3f ms"
+			" (step %d)\n", sq.n, min_gap / 1e6,
+			sq.step[min_at].line);
+	printf("%d steps late (%d at worst case), max lateness %.3f ms"
+		" (worst %.3f ms)\n", n_typ, n_worst, max_typ / 1e6,
+		max_worst / 1e6);
+
+	free(typ);
+	free(worst);
+	seq_free(&sq);
+	return n_typ ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ckpt.c: checkpoints of a playing sequence, and resuming from them
+ *
+ * With -K file, seq_play() records the position in the sequence and the
+ * port state of every device after each acknowledged step.  The file is
+ * mapped shared, so a record is a few stores to memory; the kernel keeps
+ * them when the process dies (err() on a failed transfer, a signal), and
+ * msync() every USBIO_CKPT_SYNC steps pushes them to disk for a crash of
+ * the whole machine.
+ *
+ * -m resume compiles the same sequence again (same -s, values and -O),
+ * checks it against the hash in the checkpoint, writes the recorded state
+ * to every device in one report each and continues with the first step
+ * that was not acknowledged.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>	/* errx(), warn() */
+#include <fcntl.h>	/* open() */
+#include <stdio.h>
+#include <stdlib.h>	/* exit() */
+#include <string.h>	/* memset() */
+#include <unistd.h>	/* ftruncate() */
+
+#include "usbio.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+/*
+ * FNV-1a hash of what a sequence writes, not of where it came from
+ */
+static uint64_t
+ckpt_hash(struct seq *sq) {
+	struct seq_step *st;
+	unsigned char b[16];
+	uint64_t h = FNV_OFFSET;
+	int i, j;
+
+	for (i = 0; i < sq->n; i++) {
+		st = &sq->step[i];
+		for (j = 0; j < 8; j++)
+			b[j] = st->t >> (j * 8);
+		b[8] = st->dev;
+		b[9] = st->dev >> 8;
+		b[10] = st->ports;
+		b[11] = st->val[0];
+		b[12] = st->val[1];
+		b[13] = st->mask[0];
+		b[14] = st->mask[1];
+		b[15] = 0;
+		for (j = 0; j < sizeof(b); j++) {
+			h ^= b[j];
+			h *= FNV_PRIME;
+		}
+	}
+	return h;
+}
+
+/*
+ * map a checkpoint file for a sequence
+ *   create: start a new checkpoint, otherwise the file must be one of
+ *   this sequence on as many devices, and not completed
+ *   return NULL on error, after telling why
+ */
+struct usbio_ckpt *
+ckpt_open(const char *path, struct seq *sq, int create) {
+	struct usbio_ckpt *ck;
+	struct stat st;
+	int fd;
+
+	fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+	if (fd == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if ((create && ftruncate(fd, sizeof(*ck)) == -1) ||
+	    fstat(fd, &st) == -1) {
+		warn("%s", path);
+		goto bad;
+	}
+	if (st.st_size != sizeof(*ck)) {
+		fprintf(stderr, "%s: not a checkpoint\n", path);
+		goto bad;
+	}
+	ck = mmap(NULL, sizeof(*ck), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		0);
+	if (ck == MAP_FAILED) {
+		warn("mmap");
+		goto bad;
+	}
+	close(fd);
+
+	if (create) {
+		ck->magic = USBIO_CKPT_MAGIC;
+		ck->nsteps = sq->n;
+		ck->hash = ckpt_hash(sq);
+		ck->ndevs = ndevs;
+		return ck;
+	}
+
+	if (ck->magic != USBIO_CKPT_MAGIC)
+		fprintf(stderr, "%s: not a checkpoint\n", path);
+	else if (ck->nsteps != sq->n || ck->hash != ckpt_hash(sq))
+		fprintf(stderr, "%s: checkpoint of another sequence\n", path);
+	else if (ck->ndevs != ndevs)
+		fprintf(stderr, "%s: checkpoint of %u devices, %d opened\n",
+			path, ck->ndevs, ndevs);
+	else if (ck->done)
+		fprintf(stderr, "%s: sequence already completed\n", path);
+	else
+		return ck;
+	munmap(ck, sizeof(*ck));
+	return NULL;
+bad:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * record that step i has been acknowledged
+ */
+void
+ckpt_step(struct usbio_ckpt *ck, struct seq *sq, int i) {
+	struct seq_step *st = &sq->step[i];
+
+	ck->out[st->dev][0] = devs[st->dev].out[0];
+	ck->out[st->dev][1] = devs[st->dev].out[1];
+	ck->t = st->t;
+	ck->next = i + 1;
+	if ((i + 1) % USBIO_CKPT_SYNC == 0)
+		msync(ck, sizeof(*ck), MS_ASYNC);
+}
+
+void
+ckpt_close(struct usbio_ckpt *ck) {
+	msync(ck, sizeof(*ck), MS_SYNC);
+	munmap(ck, sizeof(*ck));
+}
+
+/*
+ * resume mode
+ *   the sequence is given as to the interrupted run, -K its checkpoint
+ */
+int
+resume_main(int fd, int argc, char *argv[]) {
+	struct seq sq;
+	struct usbio_ckpt *ck;
+	int ret;
+
+	if (opts.ckpt == NULL)
+		errx(1, "resume: no checkpoint given (-K)");
+
+	memset(&sq, 0, sizeof(sq));
+	if (opts.seqfile != NULL) {
+		if (seq_compile_file(&sq, opts.seqfile) == -1)
+			exit(1);
+	} else
+		seq_compile_args(&sq, opts.port, argc, argv);
+	if (seq_devices(&sq, opts.seqfile ? opts.seqfile : "values") == -1)
+		exit(1);
+	seq_sort(&sq);
+	if (opts.tolerance >= 0)
+		seq_optimize(&sq, opts.tolerance * 1000000ULL);
+
+	if ((ck = ckpt_open(opts.ckpt, &sq, 0)) == NULL) {
+		seq_free(&sq);
+		return 1;
+	}
+	printf("resuming at step %u of %d (%.3f s)\n", ck->next, sq.n,
+		ck->t / 1e9);
+	fflush(stdout);
+
+	ret = seq_play(&sq, ck);
+	ckpt_close(ck);
+	seq_free(&sq);
+	return ret;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * clock.c: the monotonic clock of usbio_nsec()
+ *
+ * Reports, replies and samples are all timestamped (traces, captures,
+ * bench and the schedules of the modes), so at high rates the clock is
+ * read often.  On amd64 with an invariant TSC, usbio_nsec() reads the TSC
+ * and scales it onto CLOCK_MONOTONIC; elsewhere, with USBIO_NO_TSC, or
+ * until the TSC is calibrated, it calls clock_gettime(2).
+ *
+ * Calibrating costs nothing at start, so one-shot runs stay fast: the
+ * first call notes a pair of TSC and clock_gettime() readings and the
+ * first call CLOCK_CAL later computes the scale from the two pairs.  From
+ * then on, up to every CLOCK_RECAL, the next call takes a new pair and
+ * computes the scale from the last one, following any drift between the
+ * clocks without stepping back, see clock_calibrate().  Scales are
+ * written to the slot not in use and published with one atomic store, so
+ * threads read the old one or the new one, whole.
+ *
+ * -m clock calibrates, then prints the scale, the drift from
+ * clock_gettime() and the cost of a timestamp of each source.
+ */
+
+#include <err.h>	/* errx() */
+#include <stdio.h>
+#include <time.h>	/* clock_gettime(), nanosleep() */
+
+#include "usbio.h"
+
+#if (defined(__amd64__) || defined(__x86_64__)) && !defined(USBIO_NO_TSC)
+#define CLOCK_TSC
+#endif
+
+#define CLOCK_CAL	10000000ULL	/* ns, the first baseline */
+#define CLOCK_RECAL	1000000000ULL	/* ns between calibrations */
+#define CLOCK_CALLS	10000000	/* timestamps timed by -m clock */
+
+static uint64_t
+clock_mono(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef CLOCK_TSC
+struct clock_scale {
+	uint64_t	tsc, ns;	/* the clock at tsc */
+	uint64_t	mono;		/* clock_gettime() at tsc */
+	uint64_t	mult;		/* ns per tick, 32.32 fixed point */
+	uint64_t	recal;		/* ticks from tsc to the next pair */
+};
+
+static struct clock_scale clock_scale[2];
+static int clock_cur = -1;		/* slot in use, -1: none yet */
+static int clock_tsc = -1;		/* usable, -1: not probed */
+static int clock_busy = 0;		/* a thread is calibrating */
+static uint64_t clock_tsc0 = 0, clock_ns0;	/* the first pair */
+static uint64_t clock_recals = 0;
+
+static inline uint64_t
+clock_rdtsc(void) {
+	uint32_t lo, hi;
+
+	__asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
+/*
+ * does the TSC tick at a constant rate, in all power states?
+ */
+static int
+clock_probe(void) {
+	uint32_t a, b, c, d;
+
+	__asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		: "a" (0x80000000));
+	if (a < 0x80000007)
+		return 0;
+	__asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		: "a" (0x80000007));
+	return (d & (1 << 8)) != 0;
+}
+
+/*
+ * take a pair of readings, and a new scale if it is time
+ *   The rate comes from the pairs, the clock keeps going from where the
+ *   last scale got it; if that is ahead of clock_gettime(), the scale is
+ *   slowed to be back on it at the next pair.  The next pair is ten
+ *   times the baseline later, up to CLOCK_RECAL, so the first, short
+ *   baselines are soon replaced by long ones.
+ */
+static void
+clock_calibrate(void) {
+	struct clock_scale *s, *o = NULL;
+	uint64_t ns, tsc, tsc0, ns0, t, rate, ahead, period;
+	int cur;
+
+	if (__atomic_exchange_n(&clock_busy, 1, __ATOMIC_ACQUIRE))
+		return;		/* another thread is at it */
+	ns = clock_mono();
+	tsc = clock_rdtsc();
+	cur = clock_cur;
+	if (cur == -1) {
+		if (clock_tsc0 == 0) {
+			clock_tsc0 = tsc;
+			clock_ns0 = ns;
+		}
+		if (ns - clock_ns0 < CLOCK_CAL || tsc <= clock_tsc0)
+			goto out;
+		tsc0 = clock_tsc0;
+		ns0 = clock_ns0;
+		t = ns;
+	} else {
+		o = &clock_scale[cur];
+		if (tsc - o->tsc < o->recal || tsc <= o->tsc)
+			goto out;	/* done by another thread */
+		tsc0 = o->tsc;
+		ns0 = o->mono;
+		t = o->ns + (uint64_t)(((unsigned __int128)(tsc - o->tsc) *
+			o->mult) >> 32);
+	}
+	rate = (uint64_t)(((unsigned __int128)(ns - ns0) << 32) /
+		(tsc - tsc0));
+	if (rate == 0)
+		goto out;
+	period = (ns - ns0) * 10;
+	if (period > CLOCK_RECAL)
+		period = CLOCK_RECAL;
+	ahead = t > ns ? t - ns : 0;
+	if (ahead > period / 2)
+		ahead = period / 2;
+
+	s = &clock_scale[cur == 0 ? 1 : 0];
+	s->tsc = tsc;
+	s->ns = t > ns ? t : ns;
+	s->mono = ns;
+	s->mult = rate - (uint64_t)((unsigned __int128)rate * ahead / period);
+	s->recal = (uint64_t)(((unsigned __int128)period << 32) / rate);
+	__atomic_store_n(&clock_cur, cur == 0 ? 1 : 0, __ATOMIC_RELEASE);
+	clock_recals++;
+out:
+	__atomic_store_n(&clock_busy, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+/*
+ * monotonic clock in nanoseconds
+ */
+uint64_t
+usbio_nsec(void) {
+#ifdef CLOCK_TSC
+	const struct clock_scale *s;
+	uint64_t tsc;
+	int cur;
+
+	if (clock_tsc == -1)
+		clock_tsc = clock_probe();
+	if (clock_tsc) {
+		tsc = clock_rdtsc();
+		cur = __atomic_load_n(&clock_cur, __ATOMIC_ACQUIRE);
+		if (cur == -1 || tsc - clock_scale[cur].tsc >=
+		    clock_scale[cur].recal) {
+			clock_calibrate();
+			cur = __atomic_load_n(&clock_cur, __ATOMIC_ACQUIRE);
+			if (cur == -1)
+				return clock_mono();
+		}
+		s = &clock_scale[cur];
+		if (tsc <= s->tsc)
+			return s->ns;	/* read before another thread's pair */
+		return s->ns + (uint64_t)(((unsigned __int128)(tsc - s->tsc) *
+			s->mult) >> 32);
+	}
+#endif
+	return clock_mono();
+}
+
+/*
+ * clock mode
+ *   opts.count: timestamps to time, opts.duration: seconds to watch drift
+ */
+int
+clock_main(int fd, int argc, char *argv[]) {
+	struct timespec ts = { 0, 1000000 };
+	volatile uint64_t sink;
+	uint64_t t, t0, c0, dt, dc, drift = 0;
+	int i, n = opts.count > 0 ? opts.count : CLOCK_CALLS;
+	int64_t d;
+
+	if (argc > 0)
+		errx(1, "clock: no arguments");
+	/* calibrate */
+	t0 = clock_mono();
+	while (clock_mono() - t0 < 2 * CLOCK_CAL) {
+		usbio_nsec();
+		nanosleep(&ts, NULL);
+	}
+#ifdef CLOCK_TSC
+	if (clock_tsc && clock_cur != -1)
+		printf("source: tsc, %.6f MHz, calibrated over %.1f ms\n",
+			4294967296.0 * 1e3 / clock_scale[clock_cur].mult,
+			(clock_scale[clock_cur].ns - clock_ns0) / 1e6);
+	else
+#endif
+		printf("source: clock_gettime\n");
+
+	/* drift from clock_gettime(), across calibrations */
+	t0 = clock_mono();
+	c0 = usbio_nsec();
+	for (i = 0; i < (opts.duration > 0 ? opts.duration : 1) * 100; i++) {
+		ts.tv_nsec = 10000000;
+		nanosleep(&ts, NULL);
+		t = clock_mono();
+		d = (int64_t)(usbio_nsec() - c0) - (int64_t)(t - t0);
+		if ((uint64_t)(d < 0 ? -d : d) > drift)
+			drift = d < 0 ? -d : d;
+	}
+	printf("drift from clock_gettime: max %llu ns over %.1f s\n",
+		(unsigned long long)drift, (clock_mono() - t0) / 1e9);
+
+	/* cost of a timestamp */
+	t0 = clock_mono();
+	for (i = 0; i < n; i++)
+		sink = usbio_nsec();
+	dt = clock_mono() - t0;
+	t0 = clock_mono();
+	for (i = 0; i < n; i++)
+		sink = clock_mono();
+	dc = clock_mono() - t0;
+	(void)sink;
+	printf("usbio_nsec: %.1f ns, clock_gettime: %.1f ns per timestamp"
+		" (%d calls)\n", (double)dt / n, (double)dc / n, n);
+#ifdef CLOCK_TSC
+	printf("calibrations: %llu\n", (unsigned long long)clock_recals);
+#endif
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * count.c: pulse counter and frequency meter on input pins
+ *
+ * All 12 pins are sampled with pin-only USBIO2_RW requests, back to back
+ * unless -r limits the sample rate.  A pin is numbered 0-7 for port 1
+ * and 8-11 for port 2; pins to be measured must have been set high so
+ * that an external signal can pull them low.
+ *
+ * Rising edges of all pins are counted at once with a bit-sliced
+ * (vertical) counter: plane[k] holds bit k of every pin's count, so one
+ * sample costs a few word operations however many pins toggle.
+ */
+
+#include <math.h>	/* sqrt() */
+#include <stdio.h>
+#include <string.h>	/* memset() */
+
+#include "usbio.h"
+
+#define COUNT_PINS		12
+#define COUNT_PLANES		32
+#define COUNT_DEFAULT_GATE	1000	/* frequency meter gate in ms */
+
+struct count_pin {
+	uint64_t	last;		/* time of the last rising edge */
+	uint64_t	periods;	/* number of measured periods */
+	double		mean;		/* mean period in ns */
+	double		m2;		/* sum of squared deviations */
+	uint64_t	min, max;
+};
+
+struct count_state {
+	uint16_t	plane[COUNT_PLANES];
+	struct count_pin pin[COUNT_PINS];
+	uint64_t	samples;
+	uint64_t	start;
+	uint64_t	gap_max;	/* longest interval between samples */
+};
+
+/*
+ * add one to the count of every pin set in rise
+ */
+static void
+count_add(struct count_state *cs, uint16_t rise) {
+	uint16_t carry;
+	int k;
+
+	for (k = 0; rise != 0 && k < COUNT_PLANES; k++) {
+		carry = cs->plane[k] & rise;
+		cs->plane[k] ^= rise;
+		rise = carry;
+	}
+}
+
+static uint32_t
+count_get(struct count_state *cs, int pin) {
+	uint32_t n = 0;
+	int k;
+
+	for (k = 0; k < COUNT_PLANES; k++)
+		n |= (uint32_t)((cs->plane[k] >> pin) & 1) << k;
+	return n;
+}
+
+/*
+ * record rising edge times, for period and jitter estimation
+ *   an edge happened somewhere between the two samples, take the middle
+ */
+static void
+count_period(struct count_state *cs, uint16_t rise, uint64_t t) {
+	struct count_pin *p;
+	uint64_t period;
+	double delta;
+	int pin;
+
+	for (pin = 0; rise != 0; pin++, rise >>= 1) {
+		if ((rise & 1) == 0)
+			continue;
+		p = &cs->pin[pin];
+		if (p->last != 0) {
+			period = t - p->last;
+			p->periods++;
+			delta = period - p->mean;
+			p->mean += delta / p->periods;
+			p->m2 += delta * (period - p->mean);
+			if (p->min == 0 || period < p->min)
+				p->min = period;
+			if (period > p->max)
+				p->max = period;
+		}
+		p->last = t;
+	}
+}
+
+static void
+count_report(struct count_state *cs, uint64_t now, int freq) {
+	struct count_pin *p;
+	uint64_t elapsed = now - cs->start;
+	uint32_t n;
+	int pin;
+
+	printf("%llu samples in %.3f s, %.1f samples/s, max gap %llu us\n",
+		(unsigned long long)cs->samples, elapsed / 1e9,
+		elapsed ? cs->samples * 1e9 / elapsed : 0.0,
+		(unsigned long long)cs->gap_max / 1000);
+	for (pin = 0; pin < COUNT_PINS; pin++) {
+		p = &cs->pin[pin];
+		n = count_get(cs, pin);
+		if (n == 0)
+			continue;
+		printf("pin %d.%d: %u edges", pin < 8 ? 1 : 2, pin % 8, n);
+		if (freq && p->periods > 0)
+			printf(", %.3f Hz, period %.3f ms"
+				" (min %.3f, max %.3f), jitter %.3f ms",
+				1e9 / p->mean, p->mean / 1e6,
+				p->min / 1e6, p->max / 1e6,
+				p->periods > 1 ?
+				sqrt(p->m2 / (p->periods - 1)) / 1e6 : 0.0);
+		else if (freq)
+			printf(", %.3f Hz", elapsed ? n * 1e9 / elapsed : 0.0);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/*
+ * counter and frequency meter modes
+ *   "count" reports the totals on exit,
+ *   "freq" reports every gate time (-n, in ms) and restarts counting
+ */
+static int
+count_run(int fd, int freq) {
+	struct count_state cs;
+	unsigned char buf[USBIO_REPORT_SIZE];
+	uint64_t t, prev_t, gate, interval, end, last;
+	uint16_t w, prev = 0;
+	int first = 1, i;
+
+	gate = (uint64_t)(opts.count > 0 ? opts.count : COUNT_DEFAULT_GATE)
+		* 1000000;
+	interval = opts.rate > 0 ? 1000000000ULL / opts.rate : 0;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.start = prev_t = usbio_nsec();
+	end = opts.duration ? cs.start + opts.duration * 1000000000ULL : 0;
+
+	while (!interrupted) {
+		usbio_frame2(buf, 0, 0, 0);
+		if (usbio_xfer2(fd, buf) == -1)
+			break;
+		t = usbio_nsec();
+		w = buf[USBIO_REPLY_PORT1] |
+			(buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK) << 8;
+
+		if (!first) {
+			uint16_t rise = w & ~prev;
+
+			if (rise) {
+				count_add(&cs, rise);
+				count_period(&cs, rise, prev_t + (t - prev_t) / 2);
+			}
+			if (t - prev_t > cs.gap_max)
+				cs.gap_max = t - prev_t;
+		}
+		first = 0;
+		prev = w;
+		prev_t = t;
+		cs.samples++;
+
+		if (freq && t - cs.start >= gate) {
+			count_report(&cs, t, freq);
+			/* keep edge times, so periods span gates */
+			memset(cs.plane, 0, sizeof(cs.plane));
+			for (i = 0; i < COUNT_PINS; i++) {
+				last = cs.pin[i].last;
+				memset(&cs.pin[i], 0, sizeof(cs.pin[i]));
+				cs.pin[i].last = last;
+			}
+			cs.samples = 0;
+			cs.gap_max = 0;
+			cs.start = t;
+		}
+		if (end && t >= end)
+			break;
+		if (interval)
+			usbio_sleep_until(t + interval);
+	}
+
+	if (cs.samples > 0)
+		count_report(&cs, usbio_nsec(), freq);
+	return 0;
+}
+
+int
+count_main(int fd, int argc, char *argv[]) {
+	return count_run(fd, 0);
+}
+
+int
+freq_main(int fd, int argc, char *argv[]) {
+	return count_run(fd, 1);
+}
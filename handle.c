@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * handle.c: device handles of a long running mode
+ *
+ * With -I idle_ms[:maxopen], a long running mode (serve) does not hold
+ * every device open: a device given by -f is opened on first use, and one
+ * not used for idle_ms, or the least recently used one beyond maxopen
+ * open devices, is closed.  Its entry in devs[] stays, with the identity
+ * and the shadow of its outputs, so that it is reopened by its path,
+ * without looking it up again; a reopened node must still be the same
+ * device, or that use fails, without exiting.  The open devices are kept
+ * in a list by last use, so finding the idle ones only looks at its tail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>	/* strtol() */
+#include <string.h>	/* strcmp() */
+#include <unistd.h>	/* close() */
+
+#include "usbio.h"
+
+static int handle_on = 0;
+static uint64_t handle_idle_ns = 0;	/* 0: never idle */
+static int handle_max = 0;		/* open devices, 0: no limit */
+
+/* open devices, most recently used first, by index in devs[] */
+static int lru_prev[USBIO_MAXDEVS], lru_next[USBIO_MAXDEVS];
+static int lru_head = -1, lru_tail = -1;
+static int lru_n = 0;
+static uint64_t lru_used[USBIO_MAXDEVS];
+
+/* statistics */
+static uint64_t handle_hits = 0, handle_opens = 0, handle_closes = 0;
+static uint64_t handle_open_sum = 0, handle_open_max = 0;
+
+/*
+ * parse -I
+ */
+int
+handle_parse(const char *spec) {
+	char *ep;
+	long idle, max = 0;
+
+	idle = strtol(spec, &ep, 10);
+	if (*ep == ':')
+		max = strtol(ep + 1, &ep, 10);
+	if (*ep != '\0' || idle < 0 || max < 0 || max > USBIO_MAXDEVS)
+		return -1;
+	handle_on = 1;
+	handle_idle_ns = idle * 1000000ULL;
+	handle_max = max;
+	return 0;
+}
+
+/*
+ * are handles managed, so that devices may be opened on first use?
+ */
+int
+handle_lazy(void) {
+	return handle_on;
+}
+
+static void
+lru_unlink(int d) {
+	if (lru_prev[d] != -1)
+		lru_next[lru_prev[d]] = lru_next[d];
+	else
+		lru_head = lru_next[d];
+	if (lru_next[d] != -1)
+		lru_prev[lru_next[d]] = lru_prev[d];
+	else
+		lru_tail = lru_prev[d];
+	lru_n--;
+}
+
+static void
+lru_push(int d, uint64_t now) {
+	lru_prev[d] = -1;
+	lru_next[d] = lru_head;
+	if (lru_head != -1)
+		lru_prev[lru_head] = d;
+	else
+		lru_tail = d;
+	lru_head = d;
+	lru_used[d] = now;
+	lru_n++;
+}
+
+static void
+handle_close(int d) {
+	lru_unlink(d);
+	close(devs[d].fd);
+	devs[d].fd = -1;
+	handle_closes++;
+	DPRINTF("handle: %s closed\n", devs[d].path);
+}
+
+/*
+ * take over the devices main() opened
+ */
+void
+handle_init(void) {
+	uint64_t now = usbio_nsec();
+	int d;
+
+	if (!handle_on)
+		return;
+	for (d = ndevs - 1; d >= 0; d--)
+		if (devs[d].fd != -1)
+			lru_push(d, now);
+	while (handle_max > 0 && lru_n > handle_max)
+		handle_close(lru_tail);
+}
+
+/*
+ * the file descriptor of device d, opening it if it is closed
+ *   return -1 if it can not be reopened
+ */
+int
+usbio_handle(int d) {
+	struct usbio_dev *ud = &devs[d];
+	struct usbio_dev id;
+	uint64_t now, t;
+	int fd;
+
+	if (!handle_on)
+		return ud->fd;
+	now = usbio_nsec();
+	if (ud->fd != -1) {
+		handle_hits++;
+		if (lru_head != d) {
+			lru_unlink(d);
+			lru_push(d, now);
+		} else
+			lru_used[d] = now;
+		return ud->fd;
+	}
+
+	if (handle_max > 0 && lru_n >= handle_max)
+		handle_close(lru_tail);
+	memset(&id, 0, sizeof(id));
+	fd = usbio_open(ud->path, &id);
+	if (fd == -1) {
+		fprintf(stderr, "can not open USB-IO device on %s\n",
+			ud->path);
+		return -1;
+	}
+	if (ud->vendor != 0 && (id.vendor != ud->vendor ||
+	    id.product != ud->product || strcmp(id.serial, ud->serial) != 0)) {
+		fprintf(stderr, "%s: another device (serial %s, was %s)\n",
+			ud->path, id.serial, ud->serial);
+		close(fd);
+		return -1;
+	}
+	if (ud->vendor == 0) {
+		/* first use of a -f device */
+		ud->vendor = id.vendor;
+		ud->product = id.product;
+		ud->bus = id.bus;
+		ud->addr = id.addr;
+		ud->hubport = id.hubport;
+		strlcpy(ud->serial, id.serial, sizeof(ud->serial));
+	}
+	ud->fd = fd;
+	wear_attach(d);
+	t = usbio_nsec() - now;
+	handle_opens++;
+	handle_open_sum += t;
+	if (t > handle_open_max)
+		handle_open_max = t;
+	lru_push(d, now);
+	DPRINTF("handle: %s opened in %llu us\n", ud->path,
+		(unsigned long long)t / 1000);
+	return fd;
+}
+
+/*
+ * close the devices idle at now
+ *   return when the next one will be idle, 0 if none
+ */
+uint64_t
+handle_idle(uint64_t now) {
+	if (!handle_on || handle_idle_ns == 0)
+		return 0;
+	while (lru_tail != -1 && lru_used[lru_tail] + handle_idle_ns <= now)
+		handle_close(lru_tail);
+	return lru_tail != -1 ? lru_used[lru_tail] + handle_idle_ns : 0;
+}
+
+void
+handle_report(void) {
+	uint64_t n = handle_hits + handle_opens;
+
+	if (!handle_on || n == 0)
+		return;
+	printf("handles: %llu uses, hit rate %.1f%%, %llu opens"
+		" (us: avg %llu max %llu), %llu closes, %d open\n",
+		(unsigned long long)n, 100.0 * handle_hits / n,
+		(unsigned long long)handle_opens, (unsigned long long)
+		(handle_opens ? handle_open_sum / handle_opens / 1000 : 0),
+		(unsigned long long)handle_open_max / 1000,
+		(unsigned long long)handle_closes, lru_n);
+}
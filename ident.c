@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ident.c: selecting devices by identity
+ *
+ * uhid numbering changes across reboots and replugs, so -i selects a
+ * device by what it is rather than where it is attached now:
+ *	serial=SERIAL		USB serial number
+ *	product=0xPPPP		product ID (and vendor=0xVVVV)
+ *	port=BUS-PORT		physical port, bus and port on the hub
+ * joined by ',' when several must match.
+ *
+ * The identities of all devices in the device directory are read in one
+ * enumeration pass into an index, which is kept in USBIO_INDEX_FILE under
+ * $HOME.  A later run looks the selector up there and opens that node
+ * only; the identity read on open must still match, otherwise (a board
+ * moved, another one took its node) the directory is enumerated again
+ * and the index rewritten.  usbio_lookup() goes through the index too,
+ * so a one-shot run opens the device it found last time and nothing else;
+ * on a miss it enumerates the directory but leaves the index file alone,
+ * so a run without -i never writes it.  -i "" selects any device and
+ * rewrites the index as any -i does.
+ */
+
+#include <sys/stat.h>
+
+#include <fcntl.h>	/* open() */
+#include <stdio.h>
+#include <stdlib.h>	/* getenv(), strtol() */
+#include <string.h>	/* strcmp(), strlcpy() */
+#include <unistd.h>	/* close(), read() */
+
+#include "usbio.h"
+
+#define USBIO_INDEX_FILE	".usbioctl.index"
+#define IDENT_MINSCAN		10	/* uhid0-9 are always tried */
+
+struct ident {
+	char		path[256];
+	char		serial[128];
+	uint16_t	vendor;
+	uint16_t	product;
+	uint8_t		bus;
+	uint8_t		hubport;
+};
+
+static struct ident idents[USBIO_MAXDEVS];
+static int nidents = 0;
+static int ident_loaded = 0;	/* from the index file */
+static int ident_scanned = 0;	/* from the device directory */
+
+static void
+ident_from(struct ident *id, const struct usbio_dev *ud) {
+	strlcpy(id->path, ud->path, sizeof(id->path));
+	strlcpy(id->serial, ud->serial, sizeof(id->serial));
+	id->vendor = ud->vendor;
+	id->product = ud->product;
+	id->bus = ud->bus;
+	id->hubport = ud->hubport;
+}
+
+/*
+ * is path taken by another entry of devs[]?
+ */
+static int
+ident_taken(const char *path, const struct usbio_dev *ud) {
+	int i;
+
+	for (i = 0; i < ndevs; i++)
+		if (&devs[i] != ud && strcmp(devs[i].path, path) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * does an identity match a selector?
+ */
+static int
+ident_match(const char *sel, const struct ident *id) {
+	char buf[256], *s, *v, *ep, *last;
+	long n, port;
+
+	strlcpy(buf, sel, sizeof(buf));
+	for (s = strtok_r(buf, ",", &last); s != NULL;
+	    s = strtok_r(NULL, ",", &last)) {
+		if ((v = strchr(s, '=')) == NULL)
+			return 0;
+		*v++ = '\0';
+		if (strcmp(s, "serial") == 0) {
+			if (strcmp(v, id->serial) != 0)
+				return 0;
+		} else if (strcmp(s, "product") == 0) {
+			n = strtol(v, &ep, 0);
+			if (*ep != '\0' || n != id->product)
+				return 0;
+		} else if (strcmp(s, "vendor") == 0) {
+			n = strtol(v, &ep, 0);
+			if (*ep != '\0' || n != id->vendor)
+				return 0;
+		} else if (strcmp(s, "port") == 0) {
+			n = strtol(v, &ep, 10);
+			if (*ep != '-')
+				return 0;
+			port = strtol(ep + 1, &ep, 10);
+			if (*ep != '\0' || n != id->bus || port != id->hubport)
+				return 0;
+		} else
+			return 0;
+	}
+	return 1;
+}
+
+static int
+ident_path(char *buf, size_t len) {
+	const char *home = getenv("HOME");
+
+	if (home == NULL || *home == '\0')
+		return -1;
+	if (snprintf(buf, len, "%s/%s", home, USBIO_INDEX_FILE) >= len)
+		return -1;
+	return 0;
+}
+
+/*
+ * read the index file, if it was made for the current device directory
+ *   this is on the path of every one-shot run, so it reads the file with
+ *   a single read(2) into a static buffer, without stdio
+ */
+static void
+ident_load(void) {
+	static char buf[65536];
+	struct ident *id;
+	char path[1024], dir[256], *line, *nl;
+	unsigned int vendor, product, bus, hubport;
+	ssize_t len;
+	int fd;
+
+	ident_loaded = 1;
+	if (ident_path(path, sizeof(path)) == -1 ||
+	    (fd = open(path, O_RDONLY)) == -1)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+
+	if ((nl = strchr(buf, '\n')) == NULL ||
+	    sscanf(buf, "# %255s", dir) != 1 ||
+	    strcmp(dir, usbio_devdir) != 0)
+		return;
+	/* only complete lines */
+	for (line = nl + 1; nidents < USBIO_MAXDEVS &&
+	    (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		*nl = '\0';
+		id = &idents[nidents];
+		if (sscanf(line, "%255s %127s %x %x %u %u", id->path,
+		    id->serial, &vendor, &product, &bus, &hubport) != 6)
+			continue;
+		if (strcmp(id->serial, "-") == 0)
+			id->serial[0] = '\0';
+		id->vendor = vendor;
+		id->product = product;
+		id->bus = bus;
+		id->hubport = hubport;
+		nidents++;
+	}
+	DPRINTF("index: %d devices from %s\n", nidents, path);
+}
+
+static void
+ident_save(void) {
+	FILE *fp;
+	char path[1024], tmp[1024];
+	int i;
+
+	if (ident_path(path, sizeof(path)) == -1 ||
+	    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >=
+	    sizeof(tmp))
+		return;
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return;
+	fprintf(fp, "# %s\n", usbio_devdir);
+	for (i = 0; i < nidents; i++)
+		fprintf(fp, "%s %s %04x %04x %u %u\n", idents[i].path,
+			idents[i].serial[0] ? idents[i].serial : "-",
+			idents[i].vendor, idents[i].product, idents[i].bus,
+			idents[i].hubport);
+	if (fclose(fp) == 0)
+		rename(tmp, path);	/* readers see the old or the new one */
+	else
+		unlink(tmp);
+}
+
+/*
+ * enumerate the device directory once, rebuilding the index, and save it
+ * if asked to
+ *   like usbioctl always did, uhid0-9 are all tried even if one of them is
+ *   missing; beyond those, the scan stops at the first missing node
+ */
+static void
+ident_scan(int save) {
+	struct usbio_dev ud;
+	struct stat st;
+	char devname[256];
+	int i, fd;
+
+	ident_scanned = 1;
+	nidents = 0;
+	for (i = 0; nidents < USBIO_MAXDEVS; i++) {
+		snprintf(devname, sizeof(devname), "%s/uhid%d", usbio_devdir,
+			i);
+		if (stat(devname, &st) == -1) {
+			if (i < IDENT_MINSCAN)
+				continue;
+			break;
+		}
+		memset(&ud, 0, sizeof(ud));
+		fd = usbio_open(devname, &ud);
+		if (fd == -1)
+			continue;
+		close(fd);
+		ident_from(&idents[nidents++], &ud);
+	}
+	DPRINTF("index: %d devices found in %s\n", nidents, usbio_devdir);
+	if (save)
+		ident_save();
+}
+
+/*
+ * open the device matching sel, recording it in ud
+ *   an empty sel matches any device
+ *   the index file is rewritten on a miss, unless sel is NULL: that is
+ *   usbio_lookup(), any device with the index file only read
+ *   return its file descriptor, -1 if there is none
+ */
+int
+usbio_select(const char *sel, struct usbio_dev *ud) {
+	struct ident id;
+	const char *s = sel != NULL ? sel : "";
+	int i, fd;
+
+	if (!ident_loaded)
+		ident_load();
+	for (;;) {
+		for (i = 0; i < nidents; i++) {
+			if (!ident_match(s, &idents[i]))
+				continue;
+			if (ident_taken(idents[i].path, ud))
+				continue;
+			fd = usbio_open(idents[i].path, ud);
+			if (fd == -1)
+				continue;
+			ident_from(&id, ud);
+			if (ident_match(s, &id))
+				return fd;
+			close(fd);	/* the index is stale */
+		}
+		if (ident_scanned)
+			return -1;
+		ident_scan(sel != NULL);
+	}
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * input.c: event driven input monitor
+ *
+ * -m monitor watches the input pins of every opened device.  Each device
+ * has one pin-only request outstanding, and the process sleeps in poll(2)
+ * until a reply is readable or the next request of some device is due;
+ * nothing spins on read().
+ *
+ * The sample interval of a device adapts to its inputs: after a change it
+ * samples at the fast rate (-r, back to back by default) for INPUT_HOLD,
+ * then the interval doubles with every unchanged sample up to the slow
+ * interval (-n ms).  An idle board costs a few wakeups a second, a busy
+ * one is sampled as fast as it answers.  The board can not report a
+ * change by itself, so a pulse shorter than the slow interval may still
+ * be missed while idle; choose -n below the shortest pulse expected.
+ * A request without a reply for the slow interval, and at least
+ * INPUT_LOST, is taken as lost and sent again, so a lost reply does not
+ * silence a device.
+ *
+ * Changes are printed, or written to a capture file (-w), see capture.c.
+ * Records carry the index of the device in devs[], so the captures of
+ * several devices share one file.  With a trigger (-X), windows of every
+ * sample around it are written instead, see trigger.c.
+ */
+
+#include <sys/resource.h>	/* getrusage() */
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <poll.h>	/* ppoll() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc() */
+#include <string.h>	/* memset() */
+#include <unistd.h>	/* read() */
+
+#include "usbio.h"
+
+#define INPUT_SLOW_MS		100	/* default slow interval */
+#define INPUT_HOLD		50000000ULL	/* ns fast after a change */
+#define INPUT_STEP		1000000ULL	/* first interval backing off */
+#define INPUT_LOST		100000000ULL	/* ns, least wait for a reply */
+
+struct input_dev {
+	int		busy;		/* a request is outstanding */
+	unsigned char	seq;
+	uint64_t	sent;		/* of the outstanding request */
+	uint64_t	next;		/* when to send the next one */
+	uint64_t	interval;
+	uint64_t	changed;	/* time of the last change */
+	int		known;
+	uint16_t	pins;		/* port 1 | port 2 << 8 */
+	uint64_t	samples, edges, lost;
+};
+
+static struct usbio_capw *input_cap = NULL;
+
+static void
+input_send(struct input_dev *in, struct usbio_dev *ud, uint64_t now) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+
+	usbio_frame2(buf, 0, 0, 0);
+	in->seq = buf[USBIO_SEQNO] = ud->seqno++;
+	usbio_send2(ud->fd, buf);
+	in->sent = now;
+	in->busy = 1;
+}
+
+/*
+ * is buf the reply to the request with sequence number seq?
+ */
+int
+input_match(const unsigned char *buf, unsigned char seq) {
+	return buf[0] == USBIO2_RW && buf[USBIO_SEQNO] == seq;
+}
+
+/*
+ * write a record to the capture, or print it
+ */
+void
+input_record(const struct usbio_cap_rec *rec) {
+	if (input_cap != NULL)
+		cap_write(input_cap, rec);
+	else
+		printf("%llu.%06llu dev %d: %02x %x changed %03x\n",
+			(unsigned long long)rec->t / 1000000000,
+			(unsigned long long)rec->t / 1000 % 1000000, rec->dev,
+			rec->pins & 0xff, rec->pins >> 8, rec->changed);
+}
+
+/*
+ * a reply came, sampled somewhere between sent and now
+ */
+static void
+input_sample(struct input_dev *in, int d, unsigned char *buf,
+	uint64_t now, uint64_t fast, uint64_t slow) {
+	struct usbio_cap_rec rec;
+	uint16_t pins, changed;
+
+	pins = buf[USBIO_REPLY_PORT1] |
+		(buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK) << 8;
+	changed = in->known ? pins ^ in->pins : 0;
+	in->samples++;
+	in->edges += __builtin_popcount(changed);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.t = now;
+	rec.dev = d;
+	rec.pins = pins;
+	rec.changed = changed;
+	if (trigger_on())
+		trigger_sample(&rec);
+	else if (!in->known || changed)
+		input_record(&rec);
+	in->known = 1;
+	in->pins = pins;
+
+	/* adapt the interval */
+	if (changed) {
+		in->changed = now;
+		in->interval = fast;
+	} else if (now - in->changed >= INPUT_HOLD && in->interval < slow) {
+		in->interval = in->interval < INPUT_STEP ? INPUT_STEP :
+			in->interval * 2;
+		if (in->interval > slow)
+			in->interval = slow;
+	}
+	in->next = in->sent + in->interval;
+	in->busy = 0;
+}
+
+/*
+ * monitor mode
+ */
+int
+monitor_main(int fd, int argc, char *argv[]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct input_dev *in;
+	struct pollfd *pfd;
+	struct timespec ts, *tsp;
+	struct rusage ru;
+	uint64_t start, now, due, end, t, fast, slow, lost;
+	uint64_t samples = 0, edges = 0;
+	double cpu;
+	int d, ret;
+
+	fast = opts.rate > 0 ? 1000000000ULL / opts.rate : 0;
+	slow = (opts.count > 0 ? opts.count : INPUT_SLOW_MS) * 1000000ULL;
+	lost = slow > INPUT_LOST ? slow : INPUT_LOST;
+	in = calloc(ndevs, sizeof(*in));
+	pfd = calloc(ndevs, sizeof(*pfd));
+	if (in == NULL || pfd == NULL)
+		err(1, "calloc");
+
+	start = usbio_nsec();
+	end = opts.duration ? start + opts.duration * 1000000000ULL : 0;
+	if (opts.capture != NULL)
+		input_cap = cap_create(opts.capture, ndevs, start, 0);
+	trigger_init();
+	for (d = 0; d < ndevs; d++) {
+		pfd[d].fd = devs[d].fd;
+		pfd[d].events = POLLIN;
+		input_send(&in[d], &devs[d], start);
+	}
+
+	while (!interrupted) {
+		now = usbio_nsec();
+		if (end && now >= end)
+			break;
+		due = end;
+		for (d = 0; d < ndevs; d++) {
+			t = in[d].busy ? in[d].sent + lost : in[d].next;
+			if (due == 0 || t < due)
+				due = t;
+		}
+		tsp = NULL;
+		if (due != 0) {
+			due = due > now ? due - now : 0;
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			tsp = &ts;
+		}
+		ret = ppoll(pfd, ndevs, tsp, NULL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "ppoll");
+		}
+
+		now = usbio_nsec();
+		for (d = 0; d < ndevs && ret > 0; d++) {
+			if ((pfd[d].revents & (POLLIN | POLLHUP)) == 0)
+				continue;
+			ret--;
+			if (read(pfd[d].fd, buf, sizeof(buf)) != sizeof(buf))
+				errx(1, "%s: read failed", devs[d].path);
+			if (in[d].busy && input_match(buf, in[d].seq))
+				input_sample(&in[d], d, buf, now, fast, slow);
+		}
+		for (d = 0; d < ndevs; d++) {
+			if (in[d].busy && now - in[d].sent >= lost) {
+				/* a late reply to it is ignored */
+				in[d].lost++;
+				in[d].busy = 0;
+				in[d].next = now;
+			}
+			if (!in[d].busy && in[d].next <= now)
+				input_send(&in[d], &devs[d], now);
+		}
+	}
+	now = usbio_nsec();
+	if (input_cap != NULL && cap_close(input_cap) == -1)
+		err(1, "%s", opts.capture);
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	for (d = 0; d < ndevs; d++) {
+		printf("dev %d: %llu samples, %llu edges", d,
+			(unsigned long long)in[d].samples,
+			(unsigned long long)in[d].edges);
+		if (in[d].lost > 0)
+			printf(", %llu requests lost",
+				(unsigned long long)in[d].lost);
+		printf("\n");
+		samples += in[d].samples;
+		edges += in[d].edges;
+	}
+	printf("%d devices, %llu samples, %llu edges in %.3f s,"
+		" cpu %.3f s (%.2f%% per device)\n", ndevs,
+		(unsigned long long)samples, (unsigned long long)edges,
+		(now - start) / 1e9, cpu,
+		100.0 * cpu / ndevs / ((now - start) / 1e9));
+	trigger_report();
+	free(in);
+	free(pfd);
+	return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * plan.c: parallel playback of sequences on several devices
+ *
+ * A plan file (-s, or the first argument) maps sequence files to devices
+ * by their serial number, one
+ *	<serial> <seqfile>
+ * per line, '#' starts a comment.  All devices are found by a single
+ * scan of the device directory, so one process replaces one usbioctl per
+ * board racing the others for device nodes.  The devices of a bus are
+ * played by one writer thread, see topo.c, so a burst on a full hub does
+ * not hold up the devices of another bus; with -r, the reports of a bus
+ * keep to its budget.  A writer sends every step that is due on its bus,
+ * then takes the replies.  All writers share one time base, starting
+ * PLAN_LEAD_MS after the port state of every device has been read.  The
+ * steps of a sequence file all go to its device, the "dev:" prefix must
+ * be omitted or 0.
+ *
+ * Per device, the report gives the start offset (when the first report
+ * went out, relative to the shared start), the drift of every report
+ * against its scheduled time and the drift of the last one.
+ */
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>	/* calloc() */
+#include <string.h>	/* memset(), strcmp(), strtok_r() */
+
+#include "usbio.h"
+
+#define PLAN_LEAD_MS	100	/* from ready to the shared start */
+
+struct plan_dev {
+	struct usbio_dev	*ud;
+	struct seq		sq;
+	int			line;		/* in the plan file */
+	int			ret;
+	int			next;		/* step to play */
+	int			sent;		/* a reply is awaited */
+	unsigned char		seq;
+	/* results, in ns */
+	int			n;		/* reports sent */
+	int64_t			start;		/* first report vs. t0 */
+	int64_t			drift_sum;
+	int64_t			drift_max;
+	int64_t			drift_end;
+};
+
+/* the writer of a bus */
+struct plan_bus {
+	int			bus;		/* group in topo.c */
+	int			n;
+	struct plan_dev		**pd;
+	pthread_t		thread;
+};
+
+static uint64_t plan_t0;
+
+/*
+ * send the next step of a device
+ *   like seq_play(), but the sequence number is the device's own
+ */
+static void
+plan_send(struct plan_bus *pb, struct plan_dev *pd) {
+	struct usbio_dev *ud = pd->ud;
+	struct seq_step *st = &pd->sq.step[pd->next];
+	unsigned char buf[USBIO_REPORT_SIZE];
+	int64_t drift;
+	uint64_t t;
+	int p;
+
+	for (p = 0; p < 2; p++)
+		ud->out[p] = (ud->out[p] & ~st->mask[p]) |
+			(st->val[p] & st->mask[p]);
+	if (topo_next(pb->bus) > usbio_nsec())
+		usbio_sleep_until(topo_next(pb->bus));
+	usbio_frame2(buf, st->ports, ud->out[0], ud->out[1]);
+	pd->seq = buf[USBIO_SEQNO] = ud->seqno++;
+	t = usbio_nsec();
+	topo_take(pb->bus, t);
+	usbio_send2(ud->fd, buf);
+	pd->sent = 1;
+	pd->next++;
+
+	drift = (int64_t)(t - plan_t0 - st->t);
+	if (pd->n == 0)
+		pd->start = (int64_t)(t - plan_t0);
+	pd->drift_sum += drift;
+	if (drift > pd->drift_max)
+		pd->drift_max = drift;
+	pd->drift_end = drift;
+	pd->n++;
+}
+
+/*
+ * the thread playing the devices of one bus
+ */
+static void *
+plan_play(void *arg) {
+	struct plan_bus *pb = arg;
+	struct plan_dev *pd;
+	unsigned char buf[USBIO_REPORT_SIZE];
+	uint64_t due, t, now;
+	int i, live = pb->n;
+
+	while (live > 0 && !interrupted) {
+		/* the earliest step of the bus */
+		due = UINT64_MAX;
+		for (i = 0; i < pb->n; i++) {
+			pd = pb->pd[i];
+			if (pd->ret == 0 && pd->next < pd->sq.n &&
+			    (t = plan_t0 + pd->sq.step[pd->next].t) < due)
+				due = t;
+		}
+		if (due == UINT64_MAX)
+			break;
+		usbio_sleep_until(due);
+		if (interrupted)
+			break;
+
+		/* every step due by now, then their replies */
+		now = usbio_nsec();
+		for (i = 0; i < pb->n; i++) {
+			pd = pb->pd[i];
+			if (pd->ret == 0 && pd->next < pd->sq.n &&
+			    plan_t0 + pd->sq.step[pd->next].t <= now)
+				plan_send(pb, pd);
+		}
+		for (i = 0; i < pb->n; i++) {
+			pd = pb->pd[i];
+			if (!pd->sent)
+				continue;
+			pd->sent = 0;
+			if (usbio_read2(pd->ud->fd, pd->seq, buf) == -1) {
+				pd->ret = 1;
+				live--;
+			} else if (pd->next == pd->sq.n)
+				live--;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * read the plan file, compile the sequence of each line
+ *   return the number of devices in the plan, -1 on error
+ */
+static int
+plan_load(const char *path, struct plan_dev *pd) {
+	FILE *fp;
+	char line[1024], *s, *serial, *file, *last;
+	int lineno = 0, i, d, n = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(1, "%s", path);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((s = strchr(line, '#')) != NULL)
+			*s = '\0';
+		serial = strtok_r(line, " \t\n", &last);
+		if (serial == NULL)
+			continue;
+		file = strtok_r(NULL, " \t\n", &last);
+		if (file == NULL || strtok_r(NULL, " \t\n", &last) != NULL) {
+			fprintf(stderr, "%s:%d: syntax error\n", path, lineno);
+			goto bad;
+		}
+
+		for (d = 0; d < ndevs; d++)
+			if (strcmp(devs[d].serial, serial) == 0)
+				break;
+		if (d == ndevs) {
+			fprintf(stderr, "%s:%d: no device with serial %s\n",
+				path, lineno, serial);
+			goto bad;
+		}
+		for (i = 0; i < n; i++)
+			if (pd[i].ud == &devs[d]) {
+				fprintf(stderr, "%s:%d: %s is already played"
+					" by line %d\n", path, lineno, serial,
+					pd[i].line);
+				goto bad;
+			}
+
+		memset(&pd[n], 0, sizeof(pd[n]));
+		pd[n].ud = &devs[d];
+		pd[n].line = lineno;
+		if (seq_compile_file(&pd[n].sq, file) == -1) {
+			fprintf(stderr, "%s:%d: can not compile %s\n", path,
+				lineno, file);
+			goto bad;
+		}
+		for (i = 0; i < pd[n].sq.n; i++)
+			if (pd[n].sq.step[i].dev != 0) {
+				fprintf(stderr, "%s:%d: device %d in a plan\n",
+					file, pd[n].sq.step[i].line,
+					pd[n].sq.step[i].dev);
+				seq_free(&pd[n].sq);
+				goto bad;
+			}
+		seq_sort(&pd[n].sq);
+		if (opts.tolerance >= 0)
+			seq_optimize(&pd[n].sq, opts.tolerance * 1000000ULL);
+		n++;
+	}
+	fclose(fp);
+	return n;
+bad:
+	while (n-- > 0)
+		seq_free(&pd[n].sq);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * plan mode
+ *   the plan file comes from -s or the command line
+ *   every device found is opened, the plan picks them by serial
+ */
+int
+plan_main(int fd, int argc, char *argv[]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct usbio_bus *buses;
+	struct plan_dev *pd;
+	struct plan_bus *pb;
+	const char *path;
+	int b, i, j, n, nb, ret = 0;
+
+	if (opts.seqfile != NULL)
+		path = opts.seqfile;
+	else if (argc == 1)
+		path = argv[0];
+	else
+		errx(1, "plan: one plan file is needed");
+
+	pd = calloc(ndevs, sizeof(*pd));
+	if (pd == NULL)
+		err(1, "calloc");
+	n = plan_load(path, pd);
+	if (n == -1) {
+		free(pd);
+		return 1;
+	}
+
+	/* masked writes start from the current port state */
+	for (i = 0; i < n; i++) {
+		usbio_frame2(buf, 0, 0, 0);
+		buf[USBIO_SEQNO] = pd[i].ud->seqno;
+		usbio_send2(pd[i].ud->fd, buf);
+		if (usbio_read2(pd[i].ud->fd, pd[i].ud->seqno++, buf) == -1) {
+			warnx("%s: cannot read the port state",
+			    pd[i].ud->path);
+			free(pd);
+			return 1;
+		}
+		pd[i].ud->out[0] = buf[USBIO_REPLY_PORT1];
+		pd[i].ud->out[1] = buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK;
+		pd[i].ud->known = 1;
+	}
+
+	/* a writer for each bus with a device of the plan */
+	nb = topo_build(&buses);
+	pb = calloc(nb, sizeof(*pb));
+	if (pb == NULL)
+		err(1, "calloc");
+	for (b = 0; b < nb; b++) {
+		pb[b].bus = b;
+		if ((pb[b].pd = calloc(buses[b].ndevs,
+		    sizeof(*pb[b].pd))) == NULL)
+			err(1, "calloc");
+		for (j = 0; j < buses[b].ndevs; j++)
+			for (i = 0; i < n; i++)
+				if (pd[i].ud == &devs[buses[b].dev[j]])
+					pb[b].pd[pb[b].n++] = &pd[i];
+	}
+
+	plan_t0 = usbio_nsec() + PLAN_LEAD_MS * 1000000ULL;
+	for (b = 0; b < nb; b++)
+		if (pb[b].n > 0 && (errno = pthread_create(&pb[b].thread, NULL,
+		    plan_play, &pb[b])) != 0)
+			err(1, "pthread_create");
+	for (b = 0; b < nb; b++)
+		if (pb[b].n > 0)
+			pthread_join(pb[b].thread, NULL);
+	for (b = 0; b < nb; b++)
+		free(pb[b].pd);
+	free(pb);
+
+	printf("%-16s %-20s %7s %10s %10s %10s %10s\n", "serial", "device",
+		"reports", "start_us", "drift_avg", "drift_max", "drift_end");
+	for (i = 0; i < n; i++) {
+		printf("%-16s %-20s %7d %10lld %10lld %10lld %10lld%s\n",
+			pd[i].ud->serial, pd[i].ud->path, pd[i].n,
+			(long long)pd[i].start / 1000,
+			(long long)(pd[i].n ? pd[i].drift_sum / pd[i].n : 0)
+			/ 1000, (long long)pd[i].drift_max / 1000,
+			(long long)pd[i].drift_end / 1000,
+			pd[i].n < pd[i].sq.n ? " (incomplete)" : "");
+		if (pd[i].ret || pd[i].n < pd[i].sq.n)
+			ret = 1;
+		seq_free(&pd[i].sq);
+	}
+	free(pd);
+	return ret;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * profile.c: device latency profiles, shared with usbiosim
+ *
+ * A profile is a text file, times in microseconds:
+ *	idle	<us>
+ *	first	<p0> <p10> ... <p100>
+ *	rtt	<p0> <p10> ... <p100>
+ *	burst	<p0> <p10> ... <p100>
+ * lines starting with '#' are comments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>	/* strtoull() */
+#include <string.h>	/* memset(), strcmp(), strtok() */
+
+#include "usbio.h"
+
+static int
+profile_quantiles(uint64_t *q) {
+	char *s, *ep;
+	int i;
+
+	for (i = 0; i < USBIO_PROFILE_QUANTILES; i++) {
+		s = strtok(NULL, " \t\n");
+		if (s == NULL)
+			return -1;
+		q[i] = strtoull(s, &ep, 10) * 1000;
+		if (*ep != '\0' || (i > 0 && q[i] < q[i - 1]))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * load a profile, return -1 if it is unreadable or incomplete
+ */
+int
+profile_load(const char *path, struct usbio_profile *prof) {
+	FILE *fp;
+	char line[512], *key;
+	int seen = 0, ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	memset(prof, 0, sizeof(*prof));
+	while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+		key = strtok(line, " \t\n");
+		if (key == NULL || key[0] == '#')
+			continue;
+		if (strcmp(key, "idle") == 0) {
+			key = strtok(NULL, " \t\n");
+			if (key == NULL)
+				ret = -1;
+			else
+				prof->idle = strtoull(key, NULL, 10) * 1000;
+		} else if (strcmp(key, "first") == 0) {
+			ret = profile_quantiles(prof->first);
+			seen |= 1;
+		} else if (strcmp(key, "rtt") == 0) {
+			ret = profile_quantiles(prof->rtt);
+			seen |= 2;
+		} else if (strcmp(key, "burst") == 0) {
+			ret = profile_quantiles(prof->burst);
+			seen |= 4;
+		} else
+			ret = -1;
+	}
+	fclose(fp);
+
+	/* rtt is a must, the others fall back to it */
+	if (ret == -1 || (seen & 2) == 0)
+		return -1;
+	if ((seen & 1) == 0)
+		memcpy(prof->first, prof->rtt, sizeof(prof->rtt));
+	if ((seen & 4) == 0)
+		memcpy(prof->burst, prof->rtt, sizeof(prof->rtt));
+	return 0;
+}
+
+static void
+profile_line(FILE *fp, const char *key, uint64_t *q) {
+	int i;
+
+	fprintf(fp, "%s\t", key);
+	for (i = 0; i < USBIO_PROFILE_QUANTILES; i++)
+		fprintf(fp, "%s%llu", i ? " " : "",
+			(unsigned long long)q[i] / 1000);
+	fprintf(fp, "\n");
+}
+
+void
+profile_print(FILE *fp, struct usbio_profile *prof) {
+	fprintf(fp, "idle\t%llu\n", (unsigned long long)prof->idle / 1000);
+	profile_line(fp, "first", prof->first);
+	profile_line(fp, "rtt", prof->rtt);
+	profile_line(fp, "burst", prof->burst);
+}
+
+/*
+ * draw from a distribution given by its deciles,
+ * r is uniform over 0 .. UINT32_MAX
+ */
+uint64_t
+profile_sample(const uint64_t *q, uint32_t r) {
+	uint64_t pos, frac;
+	int i;
+
+	/* position in 1/2^32 units along the 10 intervals */
+	pos = (uint64_t)r * (USBIO_PROFILE_QUANTILES - 1);
+	i = pos >> 32;
+	frac = pos & 0xffffffff;
+	return q[i] + (((q[i + 1] - q[i]) * frac) >> 32);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * pwm.c: software PWM on output pins
+ *
+ * A PWM period is divided into report slots, the shortest interval the
+ * link can deliver a report in.  Each pin is high for its duty's number
+ * of slots starting at its phase.  All pins of both ports are merged into
+ * one timeline of port values, so edges falling in the same slot cost a
+ * single report, and phases are chosen to make edges of different pins
+ * coincide as much as possible.  The other pins of the ports keep the
+ * levels read at start, also when PWM ends.
+ */
+
+#include <err.h>	/* err() */
+#include <math.h>	/* log2() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), strtol() */
+#include <string.h>	/* memset() */
+
+#include "usbio.h"
+
+#define PWM_MAXPINS		12
+#define PWM_DEFAULT_FREQ	10	/* Hz */
+#define PWM_CALIBRATE		16	/* exchanges to measure the link */
+
+struct pwm_pin {
+	int		port;		/* 1 or 2 */
+	int		bit;
+	int		duty;		/* requested duty in percent */
+	int		on;		/* slots high per period */
+	int		phase;		/* slot of the rising edge */
+};
+
+struct pwm_event {
+	int		slot;
+	unsigned char	p1, p2;
+};
+
+static unsigned char pwm_rest[2];	/* levels of the other pins */
+
+/*
+ * parse a pin spec "port.bit:duty", duty in percent
+ */
+static int
+pwm_parse(const char *spec, struct pwm_pin *p) {
+	char *ep;
+
+	memset(p, 0, sizeof(*p));
+	p->port = (int)strtol(spec, &ep, 10);
+	if (*ep != '.')
+		return -1;
+	p->bit = (int)strtol(ep + 1, &ep, 10);
+	if (*ep != ':')
+		return -1;
+	p->duty = (int)strtol(ep + 1, &ep, 10);
+	if (*ep != '\0' || p->duty < 0 || p->duty > 100)
+		return -1;
+	if ((p->port == 1 && p->bit >= 0 && p->bit < 8) ||
+	    (p->port == 2 && p->bit >= 0 && p->bit < 4))
+		return 0;
+	return -1;
+}
+
+static int
+pwm_level(struct pwm_pin *p, int slot, int nslots) {
+	return (slot - p->phase + nslots) % nslots < p->on;
+}
+
+/*
+ * choose phases: pins are placed longest first, each at the phase where
+ * its two edges add the fewest slots not already holding an edge
+ */
+static void
+pwm_phase(struct pwm_pin *pins, int npins, int nslots, char *edge) {
+	struct pwm_pin *p, tmp;
+	int i, j, ph, cost, best, bestcost;
+
+	/* sort by on time, longest first */
+	for (i = 1; i < npins; i++)
+		for (j = i; j > 0 && pins[j - 1].on < pins[j].on; j--) {
+			tmp = pins[j];
+			pins[j] = pins[j - 1];
+			pins[j - 1] = tmp;
+		}
+
+	memset(edge, 0, nslots);
+	for (i = 0; i < npins; i++) {
+		p = &pins[i];
+		if (p->on == 0 || p->on == nslots)
+			continue;	/* constant, no edge */
+		best = 0;
+		bestcost = 3;
+		for (ph = 0; ph < nslots && bestcost > 0; ph++) {
+			cost = !edge[ph] + !edge[(ph + p->on) % nslots];
+			if (cost < bestcost) {
+				bestcost = cost;
+				best = ph;
+			}
+		}
+		p->phase = best;
+		edge[best] = 1;
+		edge[(best + p->on) % nslots] = 1;
+	}
+}
+
+/*
+ * port values of all pins at a slot
+ */
+static void
+pwm_levels(struct pwm_pin *pins, int npins, int nslots, int slot,
+	struct pwm_event *ev) {
+	int i;
+
+	ev->slot = slot;
+	ev->p1 = pwm_rest[0];
+	ev->p2 = pwm_rest[1];
+	for (i = 0; i < npins; i++) {
+		if (!pwm_level(&pins[i], slot, nslots))
+			continue;
+		if (pins[i].port == 1)
+			ev->p1 |= 1 << pins[i].bit;
+		else
+			ev->p2 |= 1 << pins[i].bit;
+	}
+}
+
+/*
+ * build the timeline of port values, one event per slot holding an edge
+ */
+static int
+pwm_timeline(struct pwm_pin *pins, int npins, int nslots, char *edge,
+	struct pwm_event *ev) {
+	int s, n = 0;
+
+	for (s = 0; s < nslots; s++)
+		if (edge[s])
+			pwm_levels(pins, npins, nslots, s, &ev[n++]);
+	return n;
+}
+
+/*
+ * pwm mode
+ *   argv: pin specs, "port.bit:duty"
+ *   -r: PWM frequency in Hz, -n: report slot in us (measured if omitted)
+ */
+int
+pwm_main(int fd, int argc, char *argv[]) {
+	struct pwm_pin pins[PWM_MAXPINS];
+	struct pwm_event *ev, init;
+	unsigned char buf[USBIO_REPORT_SIZE];
+	char *edge;
+	uint64_t slot, period, base, deadline, t, late = 0, late_max = 0;
+	uint64_t writes = 0, periods = 0, end;
+	unsigned char mask[2] = { 0, 0 };
+	int npins = argc, nslots, nev, ports = 0, edges = 0, i;
+
+	if (npins < 1 || npins > PWM_MAXPINS) {
+		fprintf(stderr, "pwm: 1 to %d pins are needed\n", PWM_MAXPINS);
+		return 1;
+	}
+	for (i = 0; i < npins; i++) {
+		if (pwm_parse(argv[i], &pins[i]) == -1) {
+			fprintf(stderr, "pwm: bad pin spec %s\n", argv[i]);
+			return 1;
+		}
+		ports |= pins[i].port == 1 ? USBIO_PORT1 : USBIO_PORT2;
+		mask[pins[i].port - 1] |= 1 << pins[i].bit;
+	}
+	if (opts.rate <= 0)
+		opts.rate = PWM_DEFAULT_FREQ;
+	period = 1000000000ULL / opts.rate;
+
+	/* the link rate bounds the slot length, the replies the levels */
+	t = usbio_nsec();
+	for (i = 0; i < PWM_CALIBRATE; i++) {
+		usbio_frame2(buf, 0, 0, 0);
+		if (usbio_xfer2(fd, buf) == -1) {
+			fprintf(stderr, "pwm: no reply\n");
+			return 1;
+		}
+	}
+	t = (usbio_nsec() - t) / PWM_CALIBRATE;
+	pwm_rest[0] = buf[USBIO_REPLY_PORT1] & ~mask[0];
+	pwm_rest[1] = buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK & ~mask[1];
+	slot = opts.count > 0 ? opts.count * 1000ULL : t;
+	nslots = period / slot;
+	if (nslots < 2) {
+		fprintf(stderr, "pwm: %d Hz is too fast for %llu us slots\n",
+			opts.rate, (unsigned long long)slot / 1000);
+		return 1;
+	}
+
+	edge = malloc(nslots);
+	ev = calloc(nslots, sizeof(*ev));
+	if (edge == NULL || ev == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < npins; i++) {
+		pins[i].on = (pins[i].duty * nslots + 50) / 100;
+		if (pins[i].on != 0 && pins[i].on != nslots)
+			edges += 2;
+	}
+	pwm_phase(pins, npins, nslots, edge);
+	nev = pwm_timeline(pins, npins, nslots, edge, ev);
+
+	printf("period %.3f ms, %d slots of %llu us (link %llu us/report)\n",
+		period / 1e6, nslots, (unsigned long long)slot / 1000,
+		(unsigned long long)t / 1000);
+	printf("resolution %d steps (%.1f bits), writes/period %d"
+		" (unmerged %d), %.1f reports/s needed, link max %.1f\n",
+		nslots, log2(nslots), nev, edges,
+		nev * 1e9 / period, 1e9 / t);
+	for (i = 0; i < npins; i++)
+		printf("pin %d.%d: duty %d%% -> %.2f%%, phase %d\n",
+			pins[i].port, pins[i].bit, pins[i].duty,
+			pins[i].on * 100.0 / nslots, pins[i].phase);
+	fflush(stdout);
+
+	/* initial levels, then only the edges need writing */
+	pwm_levels(pins, npins, nslots, 0, &init);
+	usbio_frame2(buf, ports, init.p1, init.p2);
+	if (usbio_xfer2(fd, buf) == -1) {
+		fprintf(stderr, "pwm: initial write not acknowledged\n");
+		free(ev);
+		free(edge);
+		return 1;
+	}
+
+	base = usbio_nsec();
+	end = opts.duration ? base + opts.duration * 1000000000ULL : 0;
+	while (!interrupted && (end == 0 || base < end)) {
+		for (i = 0; i < nev && !interrupted; i++) {
+			deadline = base + ev[i].slot * slot;
+			usbio_sleep_until(deadline);
+			usbio_frame2(buf, ports, ev[i].p1, ev[i].p2);
+			t = usbio_nsec();
+			if (usbio_xfer2(fd, buf) == -1)
+				goto out;
+			writes++;
+			if (t > deadline) {
+				late += t - deadline;
+				if (t - deadline > late_max)
+					late_max = t - deadline;
+			}
+		}
+		periods++;
+		base += period;
+		if (nev == 0)
+			usbio_sleep_until(base);
+		if (usbio_nsec() > base + period)
+			base = usbio_nsec();	/* fell behind, restart */
+	}
+out:
+	/* PWM pins low, the others as found */
+	usbio_frame2(buf, ports, pwm_rest[0], pwm_rest[1]);
+	if (usbio_xfer2(fd, buf) == -1)
+		fprintf(stderr, "pwm: final write not acknowledged\n");
+
+	printf("periods %llu, writes %llu, lateness avg %llu us, max %llu us\n",
+		(unsigned long long)periods, (unsigned long long)writes,
+		(unsigned long long)(writes ? late / writes / 1000 : 0),
+		(unsigned long long)late_max / 1000);
+
+	free(ev);
+	free(edge);
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * safe.c: safe state of the outputs
+ *
+ * -Z "[dev=]P1:P2,..." gives the values (hex) port 1 and port 2 of a
+ * device, or of every device without "dev=", take when usbioctl can not
+ * go on controlling them:
+ *   - SIGINT/SIGTERM: the signal handler writes the safe state at once,
+ *     with write(2) only
+ *   - an exit by a fatal error (every err() in the tree), or a mode
+ *     failing: an atexit() handler writes it, after usbio_stop() has
+ *     stopped the writers of every thread, as the err() may come from
+ *     one of the writer threads of -m plan or -m fanout
+ *   - the heartbeat of a serve mode client lapsing, see serve.c
+ * The reports are built when the devices are opened, so applying the safe
+ * state needs no allocation, formatting or locking.  After a signal, the
+ * running mode may still finish the exchange it was in, so the safe state
+ * is written again at exit, then acknowledged by a reply with its seqno
+ * and its port values; the seqno alone may be that of a reply to an
+ * earlier request still in flight.  Each time, the delay from the trigger
+ * to the last write and to the last reply is reported.  Nothing on the
+ * way exits: a device that can not be reopened is reported and skipped.
+ */
+
+#include <err.h>	/* err() */
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>	/* atexit(), strtol() */
+#include <string.h>	/* strcmp(), strlcpy(), strtok_r() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* read(), write() */
+
+#include "usbio.h"
+
+#define SAFE_SEQNO	0xff
+#define SAFE_WAIT_MS	100	/* for each reply */
+
+static unsigned char safe_val[USBIO_MAXDEVS][2];
+static char safe_set[USBIO_MAXDEVS];
+static int safe_all = 0;
+static unsigned char safe_all_val[2];
+
+/* prebuilt */
+static unsigned char safe_report[USBIO_MAXDEVS][USBIO_REPORT_SIZE];
+static unsigned char safe_out[USBIO_MAXDEVS][2];	/* their values */
+static int safe_dev[USBIO_MAXDEVS];	/* index in devs[] */
+static int safe_ndevs = 0;
+
+/* prototypes */
+static void	safe_exit(void);
+
+static volatile sig_atomic_t safe_ok = 0, safe_signalled = 0;
+static uint64_t safe_sig_trigger, safe_sig_written;
+
+/*
+ * parse -Z
+ */
+int
+safe_parse(const char *spec) {
+	char buf[1024], *s, *ep, *last;
+	long dev, p1, p2;
+
+	strlcpy(buf, spec, sizeof(buf));
+	for (s = strtok_r(buf, ",", &last); s != NULL;
+	    s = strtok_r(NULL, ",", &last)) {
+		dev = -1;
+		p1 = strtol(s, &ep, 16);
+		if (*ep == '=') {
+			dev = strtol(s, NULL, 10);
+			p1 = strtol(ep + 1, &ep, 16);
+		}
+		if (*ep != ':')
+			return -1;
+		p2 = strtol(ep + 1, &ep, 16);
+		if (*ep != '\0' || dev >= USBIO_MAXDEVS || p1 < 0 ||
+		    p1 > 0xff || p2 < 0 || p2 > 0xff)
+			return -1;
+		if (dev == -1) {
+			safe_all = 1;
+			safe_all_val[0] = p1;
+			safe_all_val[1] = p2 & USBIO_PORT2_MASK;
+		} else {
+			safe_set[dev] = 1;
+			safe_val[dev][0] = p1;
+			safe_val[dev][1] = p2 & USBIO_PORT2_MASK;
+		}
+	}
+	return 0;
+}
+
+/*
+ * build the reports for the opened devices, and arm the exit handler
+ */
+void
+safe_arm(void) {
+	unsigned char *v;
+	int d;
+
+	for (d = 0; d < ndevs; d++) {
+		if (safe_set[d])
+			v = safe_val[d];
+		else if (safe_all)
+			v = safe_all_val;
+		else
+			continue;
+		usbio_frame2(safe_report[safe_ndevs],
+			USBIO_PORT1 | USBIO_PORT2, v[0], v[1]);
+		safe_report[safe_ndevs][USBIO_SEQNO] = SAFE_SEQNO;
+		safe_out[safe_ndevs][0] = v[0];
+		safe_out[safe_ndevs][1] = v[1];
+		safe_dev[safe_ndevs] = d;
+		safe_ndevs++;
+	}
+	if (safe_ndevs > 0)
+		atexit(safe_exit);
+}
+
+/*
+ * write the safe state to every open device, async-signal-safe
+ *   a device closed by handle.c is skipped, safe_apply() reopens it
+ */
+static void
+safe_write(void) {
+	int i, fd;
+
+	for (i = 0; i < safe_ndevs; i++)
+		if ((fd = devs[safe_dev[i]].fd) != -1)
+			write(fd, safe_report[i], USBIO_REPORT_SIZE);
+}
+
+/*
+ * called from the signal handler
+ */
+void
+safe_signal(void) {
+	struct timespec ts;
+
+	if (safe_ndevs == 0 || safe_signalled)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	safe_sig_trigger = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	safe_write();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	safe_sig_written = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	safe_signalled = 1;
+}
+
+/*
+ * wait for the reply to the safe state of safe_dev[i]
+ */
+static int
+safe_ack(int fd, int i) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, SAFE_WAIT_MS) == 1 &&
+	    read(fd, buf, sizeof(buf)) == sizeof(buf))
+		if (buf[0] == USBIO2_RW && buf[USBIO_SEQNO] == SAFE_SEQNO &&
+		    buf[USBIO_REPLY_PORT1] == safe_out[i][0] &&
+		    (buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK) ==
+		    safe_out[i][1])
+			return 1;
+	return 0;
+}
+
+/*
+ * apply the safe state and wait for the replies, trigger is the time the
+ * reason for it happened
+ *   return the number of devices which acknowledged
+ */
+int
+safe_apply(const char *why, uint64_t trigger) {
+	char closed[USBIO_MAXDEVS];
+	struct usbio_dev *ud, id;
+	uint64_t written;
+	int i, fd, n = 0;
+
+	if (safe_ndevs == 0)
+		return 0;
+	safe_write();
+	written = usbio_nsec();
+	/* not in a signal handler, so the writes are counted by -R */
+	for (i = 0; i < safe_ndevs; i++)
+		if (devs[safe_dev[i]].fd != -1)
+			wear_write(devs[safe_dev[i]].fd, safe_report[i]);
+	for (i = 0; i < safe_ndevs; i++) {
+		closed[i] = devs[safe_dev[i]].fd == -1;
+		if (!closed[i])
+			n += safe_ack(devs[safe_dev[i]].fd, i);
+	}
+	/*
+	 * devices closed by handle.c, opened for the safe state only, so
+	 * that no other device is closed for them
+	 */
+	for (i = 0; i < safe_ndevs; i++) {
+		if (!closed[i])
+			continue;
+		ud = &devs[safe_dev[i]];
+		memset(&id, 0, sizeof(id));
+		if ((fd = usbio_open(ud->path, &id)) == -1) {
+			fprintf(stderr, "safe state: can not open %s\n",
+				ud->path);
+			continue;
+		}
+		if (ud->vendor != 0 && strcmp(id.serial, ud->serial) != 0) {
+			fprintf(stderr, "safe state: %s: another device\n",
+				ud->path);
+			close(fd);
+			continue;
+		}
+		write(fd, safe_report[i], USBIO_REPORT_SIZE);
+		written = usbio_nsec();
+		ud->fd = fd;
+		wear_attach(safe_dev[i]);
+		wear_write(fd, safe_report[i]);
+		n += safe_ack(fd, i);
+		close(fd);
+		ud->fd = -1;
+	}
+	fprintf(stderr, "safe state (%s): %d devices, written in %llu us,"
+		" %d acknowledged in %llu us\n", why, safe_ndevs,
+		(unsigned long long)(written - trigger) / 1000, n,
+		(unsigned long long)(usbio_nsec() - trigger) / 1000);
+	return n;
+}
+
+/*
+ * the outputs may stay as they are when usbioctl exits
+ */
+void
+safe_done(int ok) {
+	safe_ok = ok;
+}
+
+static void
+safe_exit(void) {
+	if (!safe_signalled && safe_ok)
+		return;
+	usbio_stop();
+	if (safe_signalled) {
+		fprintf(stderr, "safe state (signal): %d devices, written in"
+			" %llu us\n", safe_ndevs, (unsigned long long)
+			(safe_sig_written - safe_sig_trigger) / 1000);
+		safe_apply("signal, at exit", safe_sig_trigger);
+	} else if (!safe_ok)
+		safe_apply("exit", usbio_nsec());
+}
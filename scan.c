@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * scan.c: multiplexed display refresh and key matrix scanning
+ *
+ * Port 2 (4 bits) drives the row/digit selects, one at a time (active
+ * high).  Port 1 drives the segment pattern of the selected digit, except
+ * for the column pins given by -c, which are kept high and read back from
+ * the reply of each select write.  A pressed key pulls its column low.
+ */
+
+#include <stdio.h>
+#include <string.h>	/* memset() */
+
+#include "usbio.h"
+
+#define SCAN_MAXROWS		4	/* port 2 width */
+#define SCAN_DEFAULT_RATE	50	/* frames per second */
+#define SCAN_DEFAULT_DEBOUNCE	3	/* stable scans to accept a key */
+
+struct scan_row {
+	unsigned char	segments;	/* port 1 pattern for this digit */
+	unsigned char	keys;		/* debounced key state, 1 = pressed */
+	unsigned char	pending;	/* candidate key state */
+	int		stable;		/* scans pending has been seen */
+	uint64_t	lit;		/* time this digit was selected */
+};
+
+/*
+ * feed a raw key sample of a row into the debouncer,
+ * report key events when the new state has been stable long enough
+ */
+static void
+scan_debounce(struct scan_row *r, int row, unsigned char raw, uint64_t t) {
+	unsigned char changed;
+	int col;
+
+	if (raw == r->keys) {
+		r->stable = 0;
+		return;
+	}
+	if (raw != r->pending) {
+		r->pending = raw;
+		r->stable = 0;
+	}
+	if (++r->stable < opts.count)
+		return;
+
+	changed = raw ^ r->keys;
+	for (col = 0; col < 8; col++)
+		if (changed & (1 << col))
+			printf("%llu.%06llu key %d.%d %s\n",
+				(unsigned long long)(t / 1000000000),
+				(unsigned long long)(t % 1000000000) / 1000,
+				row, col, (raw & (1 << col)) ? "down" : "up");
+	fflush(stdout);
+	r->keys = raw;
+	r->stable = 0;
+}
+
+/*
+ * scan mode
+ *   argv: segment pattern (hex) of each digit, one digit per row
+ */
+int
+scan_main(int fd, int argc, char *argv[]) {
+	struct scan_row rows[SCAN_MAXROWS];
+	unsigned char buf[USBIO_REPORT_SIZE];
+	unsigned char colmask = opts.mask;
+	uint64_t slot, start, next, end, t, acked, rtt, rtt_max = 0;
+	uint64_t rtt_sum = 0, frames = 0, overruns = 0;
+	int nrows = argc, cur = 0, prev = -1, i, val;
+
+	if (nrows < 1 || nrows > SCAN_MAXROWS) {
+		fprintf(stderr, "scan: 1 to %d digits are needed\n",
+			SCAN_MAXROWS);
+		return 1;
+	}
+	if (opts.rate <= 0)
+		opts.rate = SCAN_DEFAULT_RATE;
+	if (opts.count <= 0)
+		opts.count = SCAN_DEFAULT_DEBOUNCE;
+
+	memset(rows, 0, sizeof(rows));
+	for (i = 0; i < nrows; i++) {
+		val = usbio_value(argv[i]);
+		if (val == -1) {
+			fprintf(stderr, "digit %d: value = %s, out of range\n",
+				i, argv[i]);
+			return 1;
+		}
+		rows[i].segments = (unsigned char)val;
+	}
+
+	slot = 1000000000ULL / ((uint64_t)opts.rate * nrows);
+	DPRINTF("scan: %d rows, %d frames/s, slot %llu us, columns 0x%02x\n",
+		nrows, opts.rate, (unsigned long long)slot / 1000, colmask);
+
+	start = next = usbio_nsec();
+	end = opts.duration ? start + opts.duration * 1000000000ULL : 0;
+	acked = start;
+
+	while (!interrupted && (end == 0 || next < end)) {
+		/* column pins stay high so that they work as inputs */
+		usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2,
+			rows[cur].segments | colmask, 1 << cur);
+		t = usbio_nsec();
+		if (usbio_xfer2(fd, buf) == -1)
+			break;
+
+		/* the previous digit was lit until this select took effect */
+		rtt = usbio_nsec() - t;
+		t += rtt;
+		if (prev != -1)
+			rows[prev].lit += t - acked;
+		acked = t;
+		rtt_sum += rtt;
+		if (rtt > rtt_max)
+			rtt_max = rtt;
+
+		if (colmask)
+			scan_debounce(&rows[cur], cur,
+				~buf[USBIO_REPLY_PORT1] & colmask, t);
+
+		prev = cur;
+		if (++cur == nrows) {
+			cur = 0;
+			frames++;
+		}
+
+		next += slot;
+		if (t > next) {
+			/* can not keep up, resynchronize */
+			overruns++;
+			next = t;
+		}
+		usbio_sleep_until(next);
+	}
+
+	/* turn off the display */
+	usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2, colmask, 0);
+	usbio_xfer2(fd, buf);
+	if (prev != -1)
+		rows[prev].lit += usbio_nsec() - acked;
+	t = usbio_nsec() - start;
+
+	printf("frames %llu, %.1f frames/s (target %d), slot overruns %llu\n",
+		(unsigned long long)frames,
+		t ? frames * 1e9 / t : 0.0, opts.rate,
+		(unsigned long long)overruns);
+	if (frames + cur > 0)
+		printf("rtt avg %llu us, max %llu us\n",
+			(unsigned long long)(rtt_sum /
+			(frames * nrows + cur) / 1000),
+			(unsigned long long)rtt_max / 1000);
+	for (i = 0; i < nrows; i++)
+		printf("digit %d duty %.1f%% (ideal %.1f%%)\n", i,
+			t ? rows[i].lit * 100.0 / t : 0.0, 100.0 / nrows);
+
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * seq.c: compiled output sequences
+ *
+ * A sequence is a time ordered list of steps; a step is one report to
+ * one device, writing port 1, port 2 or both, possibly only some bits
+ * of them.  It is compiled from the command line values (one value per
+ * USBIO_SEQ_INTERVAL, as usbioctl always did) or from a file (-s) of
+ *	<time_ms> [dev:]port=value[/mask][,...]
+ * lines, where a time of "+N" is relative to the previous line and '#'
+ * starts a comment.
+ *
+ * The optimizer (-O tolerance_ms) then
+ *   - folds masked writes into the known port value,
+ *   - merges steps of a device at most the tolerance apart into one
+ *     report, moving them earlier by at most the tolerance, unless a
+ *     step changes a bit the group already writes: that step starts a
+ *     new group, so a pulse shorter than the tolerance still shows,
+ *   - drops writes of the value a port already has.
+ */
+
+#include <ctype.h>	/* isspace() */
+#include <err.h>	/* err(), warn() */
+#include <stdio.h>
+#include <stdlib.h>	/* reallocarray(), strtol() */
+#include <string.h>	/* memset(), strtok_r() */
+
+#include "usbio.h"
+
+#define USBIO_SEQ_INTERVAL	3000	/* ms between command line values */
+
+static const unsigned char seq_portmask[2] = { 0xff, USBIO_PORT2_MASK };
+
+/*
+ * append a step, return it
+ */
+static struct seq_step *
+seq_add(struct seq *sq, uint64_t t, int dev) {
+	struct seq_step *st;
+
+	if (sq->n == sq->size) {
+		sq->size = sq->size ? sq->size * 2 : 64;
+		sq->step = reallocarray(sq->step, sq->size, sizeof(*st));
+		if (sq->step == NULL)
+			err(1, "reallocarray");
+	}
+	st = &sq->step[sq->n++];
+	memset(st, 0, sizeof(*st));
+	st->t = t;
+	st->dev = dev;
+	return st;
+}
+
+/*
+ * compile the command line values, written to one port
+ */
+void
+seq_compile_args(struct seq *sq, int port, int argc, char *argv[]) {
+	struct seq_step *st;
+	int i, val, p = port - 1;
+
+	for (i = 0; i < argc; i++) {
+		val = usbio_value(argv[i]);
+		if (val == -1)
+			errx(1, "data %d: value = %s, out of range", i,
+				argv[i]);
+		st = seq_add(sq, (uint64_t)i * USBIO_SEQ_INTERVAL * 1000000,
+			0);
+		st->ports = p ? USBIO_PORT2 : USBIO_PORT1;
+		st->mask[p] = seq_portmask[p];
+		st->val[p] = val & seq_portmask[p];
+		st->line = i + 1;
+	}
+}
+
+/*
+ * compile a sequence file
+ *   return -1 after telling why it could not be read or compiled
+ */
+int
+seq_compile_file(struct seq *sq, const char *path) {
+	FILE *fp;
+	struct seq_step *st;
+	char line[1024], *s, *tok, *ep, *last;
+	uint64_t t = 0;
+	long ms, dev, port, val, mask;
+	int lineno = 0, first, i;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		warn("%s", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((s = strchr(line, '#')) != NULL)
+			*s = '\0';
+		for (s = line; isspace((unsigned char)*s); s++)
+			;
+		if (*s == '\0')
+			continue;
+
+		ms = strtol(*s == '+' ? s + 1 : s, &ep, 10);
+		if (ep == s || ms < 0 || !isspace((unsigned char)*ep))
+			goto bad;
+		t = (*s == '+' ? t : 0) + ms * 1000000ULL;
+
+		/* one step per device on this line */
+		first = sq->n;
+		for (tok = strtok_r(ep, ", \t\n", &last); tok != NULL;
+		    tok = strtok_r(NULL, ", \t\n", &last)) {
+			dev = 0;
+			port = strtol(tok, &ep, 10);
+			if (*ep == ':') {
+				dev = port;
+				port = strtol(ep + 1, &ep, 10);
+			}
+			if (*ep != '=' || dev < 0 || dev >= USBIO_MAXDEVS ||
+			    (port != 1 && port != 2))
+				goto bad;
+			val = strtol(ep + 1, &ep, 16);
+			mask = 0xff;
+			if (*ep == '/')
+				mask = strtol(ep + 1, &ep, 16);
+			if (*ep != '\0' || val < 0 || val > 0xff ||
+			    mask < 0 || mask > 0xff)
+				goto bad;
+
+			for (i = first; i < sq->n; i++)
+				if (sq->step[i].dev == dev)
+					break;
+			st = (i < sq->n) ? &sq->step[i] : seq_add(sq, t, dev);
+			st->line = lineno;
+			port--;
+			mask &= seq_portmask[port];
+			st->ports |= port ? USBIO_PORT2 : USBIO_PORT1;
+			st->val[port] = (st->val[port] & ~mask) | (val & mask);
+			st->mask[port] |= mask;
+		}
+	}
+	fclose(fp);
+	return 0;
+bad:
+	fprintf(stderr, "%s:%d: syntax error\n", path, lineno);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * do all steps go to an opened device?  path names the sequence
+ */
+int
+seq_devices(struct seq *sq, const char *path) {
+	int i;
+
+	for (i = 0; i < sq->n; i++)
+		if (sq->step[i].dev >= ndevs) {
+			fprintf(stderr, "%s:%d: no device %d\n", path,
+				sq->step[i].line, sq->step[i].dev);
+			return -1;
+		}
+	return 0;
+}
+
+static int
+seq_cmp(const void *a, const void *b) {
+	const struct seq_step *x = a, *y = b;
+
+	if (x->t != y->t)
+		return x->t < y->t ? -1 : 1;
+	if (x->dev != y->dev)
+		return x->dev - y->dev;
+	return x->line - y->line;
+}
+
+/*
+ * sort steps by time, steps of a time by device, keeping source order
+ */
+void
+seq_sort(struct seq *sq) {
+	qsort(sq->step, sq->n, sizeof(*sq->step), seq_cmp);
+}
+
+/*
+ * does st write a bit written by grp to another value?
+ */
+static int
+seq_conflict(const struct seq_step *grp, const struct seq_step *st) {
+	int p;
+
+	for (p = 0; p < 2; p++)
+		if ((grp->val[p] ^ st->val[p]) & grp->mask[p] & st->mask[p])
+			return 1;
+	return 0;
+}
+
+/*
+ * optimize a sorted sequence, tol in ns
+ *   return the largest amount a step was moved by
+ */
+uint64_t
+seq_optimize(struct seq *sq, uint64_t tol) {
+	struct seq_step *st, *grp;
+	struct {
+		unsigned char	val[2];
+		unsigned char	known[2];	/* bits of val known */
+		int		open;		/* group being merged, or -1 */
+	} *sh;
+	uint64_t moved = 0;
+	int i, j, n, p, d, ndev = 0;
+
+	for (i = 0; i < sq->n; i++)
+		if (sq->step[i].dev >= ndev)
+			ndev = sq->step[i].dev + 1;
+	sh = calloc(ndev ? ndev : 1, sizeof(*sh));
+	if (sh == NULL)
+		err(1, "calloc");
+	for (d = 0; d < ndev; d++)
+		sh[d].open = -1;
+
+	/*
+	 * merge steps within the tolerance of their group's first step,
+	 * which write other bits, or the same values to the same bits
+	 */
+	for (i = 0; i < sq->n; i++) {
+		st = &sq->step[i];
+		d = st->dev;
+		j = sh[d].open;
+		grp = j != -1 ? &sq->step[j] : NULL;
+		if (grp != NULL && st->t - grp->t <= tol &&
+		    !seq_conflict(grp, st)) {
+			for (p = 0; p < 2; p++) {
+				grp->val[p] = (grp->val[p] & ~st->mask[p]) |
+					(st->val[p] & st->mask[p]);
+				grp->mask[p] |= st->mask[p];
+			}
+			grp->ports |= st->ports;
+			if (st->t - grp->t > moved)
+				moved = st->t - grp->t;
+			st->ports = 0;		/* merged away */
+			continue;
+		}
+		sh[d].open = i;
+	}
+
+	/* fold masks into the known state, drop writes changing nothing */
+	for (i = 0; i < sq->n; i++) {
+		st = &sq->step[i];
+		if (st->ports == 0)
+			continue;
+		d = st->dev;
+		for (p = 0; p < 2; p++) {
+			if (st->mask[p] == 0)
+				continue;
+			if ((sh[d].known[p] & ~st->mask[p]) ==
+			    (seq_portmask[p] & ~st->mask[p])) {
+				/* the rest of the port is known */
+				st->val[p] = (sh[d].val[p] & ~st->mask[p]) |
+					(st->val[p] & st->mask[p]);
+				st->mask[p] = seq_portmask[p];
+			}
+			if ((sh[d].known[p] & st->mask[p]) == st->mask[p] &&
+			    ((sh[d].val[p] ^ st->val[p]) & st->mask[p]) == 0) {
+				st->ports &= ~(p ? USBIO_PORT2 : USBIO_PORT1);
+				st->mask[p] = 0;
+			}
+			sh[d].val[p] = (sh[d].val[p] & ~st->mask[p]) |
+				(st->val[p] & st->mask[p]);
+			sh[d].known[p] |= st->mask[p];
+		}
+	}
+	free(sh);
+
+	/* squeeze out dropped steps */
+	for (i = n = 0; i < sq->n; i++)
+		if (sq->step[i].ports != 0)
+			sq->step[n++] = sq->step[i];
+	sq->n = n;
+	return moved;
+}
+
+/*
+ * play a sequence, each step is acknowledged before the next one
+ *   masked writes are resolved against the port state read at start
+ *   with a checkpoint (-K), every acknowledged step is recorded in it;
+ *   a checkpoint of an interrupted run is resumed from where it stopped
+ */
+int
+seq_play(struct seq *sq, struct usbio_ckpt *ck) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct seq_step *st;
+	struct usbio_dev *ud;
+	uint64_t start;
+	int i, d, p, first = 0;
+
+	if (ck != NULL && ck->next > 0) {
+		/* re-apply the state of the last acknowledged step */
+		first = ck->next;
+		for (d = 0; d < ndevs; d++) {
+			devs[d].out[0] = ck->out[d][0];
+			devs[d].out[1] = ck->out[d][1];
+			devs[d].known = 1;
+			usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2,
+				devs[d].out[0], devs[d].out[1]);
+			if (usbio_xfer2(devs[d].fd, buf) == -1)
+				return 1;
+		}
+	} else {
+		for (d = 0; d < ndevs; d++) {
+			usbio_frame2(buf, 0, 0, 0);
+			if (usbio_xfer2(devs[d].fd, buf) == -1) {
+				fprintf(stderr, "%s: no reply\n",
+					devs[d].path);
+				return 1;
+			}
+			devs[d].out[0] = buf[USBIO_REPLY_PORT1];
+			devs[d].out[1] = buf[USBIO_REPLY_PORT2] &
+				USBIO_PORT2_MASK;
+			devs[d].known = 1;
+			if (ck != NULL) {
+				ck->out[d][0] = devs[d].out[0];
+				ck->out[d][1] = devs[d].out[1];
+			}
+		}
+	}
+
+	/* on resume, the time after the last acknowledged step is kept */
+	start = usbio_nsec() - (first ? ck->t : 0);
+	for (i = first; i < sq->n && !interrupted; i++) {
+		st = &sq->step[i];
+		ud = &devs[st->dev];
+		for (p = 0; p < 2; p++)
+			ud->out[p] = (ud->out[p] & ~st->mask[p]) |
+				(st->val[p] & st->mask[p]);
+		usbio_sleep_until(start + st->t);
+		usbio_frame2(buf, st->ports, ud->out[0], ud->out[1]);
+		DPRINTF("step %d: t=%llu ms, dev %d, %02x %02x\n", st->line,
+			(unsigned long long)st->t / 1000000, st->dev,
+			ud->out[0], ud->out[1]);
+		if (usbio_xfer2(ud->fd, buf) == -1)
+			return 1;
+		if (ck != NULL)
+			ckpt_step(ck, sq, i);
+	}
+	if (ck != NULL && i == sq->n)
+		ck->done = 1;
+	return 0;
+}
+
+void
+seq_free(struct seq *sq) {
+	free(sq->step);
+	memset(sq, 0, sizeof(*sq));
+}
+
+/*
+ * compile (and optimize) the sequence given by -s or the command line,
+ * then play it
+ */
+int
+seq_main(int fd, int argc, char *argv[]) {
+	struct seq sq;
+	struct usbio_ckpt *ck;
+	uint64_t moved;
+	int before, ret;
+
+	memset(&sq, 0, sizeof(sq));
+	if (opts.seqfile != NULL) {
+		if (seq_compile_file(&sq, opts.seqfile) == -1)
+			exit(1);
+	} else
+		seq_compile_args(&sq, opts.port, argc, argv);
+	if (seq_devices(&sq, opts.seqfile ? opts.seqfile : "values") == -1)
+		exit(1);
+	seq_sort(&sq);
+
+	if (opts.tolerance >= 0) {
+		before = sq.n;
+		moved = seq_optimize(&sq, opts.tolerance * 1000000ULL);
+		printf("optimized: %d -> %d reports (%d saved, %.1f%%),"
+			" max shift %llu ms (tolerance %d ms)\n",
+			before, sq.n, before - sq.n,
+			before ? (before - sq.n) * 100.0 / before : 0.0,
+			(unsigned long long)moved / 1000000, opts.tolerance);
+		fflush(stdout);
+	}
+
+	ck = NULL;
+	if (opts.ckpt != NULL && (ck = ckpt_open(opts.ckpt, &sq, 1)) == NULL) {
+		seq_free(&sq);
+		return 1;
+	}
+	ret = seq_play(&sq, ck);
+	if (ck != NULL)
+		ckpt_close(ck);
+	seq_free(&sq);
+	return ret;
+}
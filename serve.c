@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * serve.c: a long running player of queued sequences, and its client
+ *
+ * -m serve keeps the devices open and takes commands, one per datagram,
+ * on a unix domain socket (-S path):
+ *	run <prio> <seqfile>	queue a sequence, the reply is its handle
+ *	cancel <handle> [safe=P1:P2]
+ *				drop what is left of a sequence, optionally
+ *				writing the safe state P1/P2 (hex) to every
+ *				device it wrote to
+ *	list			queued sequences, and failed ones
+ *	hb <ms>			heartbeat: unless another hb comes within ms,
+ *				every sequence is cancelled and the safe state
+ *				(-Z) applied; "hb 0" ends the lease
+ * Only the sequence of the highest priority plays.  One of a higher
+ * priority preempts the running one, which continues later from where it
+ * stopped: its outputs are written again and its remaining steps keep
+ * their intervals.  A queued sequence is a handle slot and a position, so
+ * cancelling it is unlinking the slot; no report is queued anywhere else.
+ * As exchanges are synchronous, none is in flight when a command is read
+ * and the safe state goes out in the very slot the next step would have
+ * used.  The reply to cancel tells the time from the command to the
+ * acknowledged safe state (cancel-to-quiet), and how many devices did not
+ * acknowledge it.
+ *
+ * A sequence whose step, or whose outputs written again on resume, a
+ * device does not acknowledge is dropped, but keeps its handle until the
+ * failure has been told by the reply to a list or to its cancel.
+ *
+ * With -r, steps keep to the report budget of their bus, see topo.c: a
+ * step due while its bus is over budget waits.  Safe states and the
+ * outputs written again on resume are not held back by the budget.
+ *
+ * With -I, devices are opened on first use and closed when idle, see
+ * handle.c.
+ *
+ * -m ctl sends its arguments as one command and prints the reply.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <poll.h>	/* ppoll() */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), mkdtemp(), strtol() */
+#include <string.h>	/* memset(), strcmp() */
+#include <time.h>
+#include <unistd.h>	/* rmdir(), unlink() */
+
+#include "usbio.h"
+
+#define SERVE_MAXSEQ	64
+#define SERVE_MSGLEN	1024
+#define SERVE_HANDLE(s)	((s)->gen << 8 | (int)((s) - serve_seqs))
+
+struct serve_seq {
+	int			used;
+	int			gen;		/* makes stale handles fail */
+	int			prio;
+	struct seq		sq;
+	int			next;		/* next step to play */
+	uint64_t		base;		/* time of step 0, or 0 */
+	uint64_t		paused;		/* when preempted, or 0 */
+	int			failed;		/* device + 1, or 0 */
+	int			failstep;
+	unsigned char		(*val)[2];	/* what it wrote, per device */
+	unsigned char		(*known)[2];
+	struct serve_seq	*prev, *nxt;	/* run queue, by priority */
+};
+
+static struct serve_seq serve_seqs[SERVE_MAXSEQ];
+static struct serve_seq *serve_head = NULL;	/* the one playing */
+static int serve_gen = 0;
+
+static uint64_t serve_hb = 0;	/* heartbeat deadline, or 0 */
+
+/* statistics */
+static int serve_cancels = 0;
+static uint64_t serve_quiet_sum = 0, serve_quiet_max = 0;
+
+/*
+ * insert s into the run queue, behind those of the same priority
+ */
+static void
+serve_link(struct serve_seq *s) {
+	struct serve_seq *p = NULL, *q;
+
+	for (q = serve_head; q != NULL && q->prio >= s->prio; q = q->nxt)
+		p = q;
+	s->prev = p;
+	s->nxt = q;
+	if (q != NULL)
+		q->prev = s;
+	if (p != NULL)
+		p->nxt = s;
+	else
+		serve_head = s;
+}
+
+static void
+serve_unlink(struct serve_seq *s) {
+	if (s->prev != NULL)
+		s->prev->nxt = s->nxt;
+	else
+		serve_head = s->nxt;
+	if (s->nxt != NULL)
+		s->nxt->prev = s->prev;
+	s->prev = s->nxt = NULL;
+}
+
+static void
+serve_release(struct serve_seq *s) {
+	seq_free(&s->sq);
+	free(s->val);
+	free(s->known);
+	s->used = 0;
+}
+
+static void	serve_switch(struct serve_seq *);
+
+/*
+ * one exchange with device d, which may have gone away or, with -I, not
+ * be there to reopen
+ *   return -1 if it is not acknowledged
+ */
+static int
+serve_xfer(int d, unsigned char *buf) {
+	int fd;
+
+	if ((fd = usbio_handle(d)) == -1)
+		return -1;
+	return usbio_try2(fd, buf);
+}
+
+/*
+ * a write of the running sequence s to device d was not acknowledged
+ * at step n, drop s
+ */
+static void
+serve_fail(struct serve_seq *s, int d, int n) {
+	printf("seq %d: %s: step %d not acknowledged, dropped\n",
+		SERVE_HANDLE(s), devs[d].path, n);
+	fflush(stdout);
+	s->failed = d + 1;
+	s->failstep = n;
+	serve_unlink(s);
+	serve_switch(s);
+}
+
+/*
+ * write what s has written so far again, after another one played
+ */
+static void
+serve_restore(struct serve_seq *s) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	int d, p;
+
+	for (d = 0; d < ndevs; d++) {
+		if ((s->known[d][0] | s->known[d][1]) == 0)
+			continue;
+		for (p = 0; p < 2; p++)
+			devs[d].out[p] = (devs[d].out[p] & ~s->known[d][p]) |
+				(s->val[d][p] & s->known[d][p]);
+		usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2, devs[d].out[0],
+			devs[d].out[1]);
+		if (serve_xfer(d, buf) == -1) {
+			serve_fail(s, d, s->next);
+			return;
+		}
+	}
+}
+
+/*
+ * the head of the run queue has changed, start or continue it
+ */
+static void
+serve_switch(struct serve_seq *old) {
+	struct serve_seq *s = serve_head;
+	uint64_t now = usbio_nsec();
+
+	if (old != NULL && old != s && old->used)
+		old->paused = now;
+	if (s == NULL || s == old)
+		return;
+	if (s->base == 0)
+		s->base = now - (s->sq.n ? s->sq.step[0].t : 0);
+	else if (s->paused) {
+		s->base += now - s->paused;
+		s->paused = 0;
+		serve_restore(s);
+	}
+}
+
+/*
+ * when may the next step of a sequence play?
+ */
+static uint64_t
+serve_due(struct serve_seq *s) {
+	struct seq_step *st = &s->sq.step[s->next];
+	uint64_t t = s->base + st->t, b = topo_next(topo_bus(st->dev));
+
+	return b > t ? b : t;
+}
+
+/*
+ * play the next step of the running sequence
+ */
+static void
+serve_step(struct serve_seq *s) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct seq_step *st = &s->sq.step[s->next++];
+	struct usbio_dev *ud = &devs[st->dev];
+	int p;
+
+	for (p = 0; p < 2; p++) {
+		ud->out[p] = (ud->out[p] & ~st->mask[p]) |
+			(st->val[p] & st->mask[p]);
+		s->val[st->dev][p] = (s->val[st->dev][p] & ~st->mask[p]) |
+			(st->val[p] & st->mask[p]);
+		s->known[st->dev][p] |= st->mask[p];
+	}
+	usbio_frame2(buf, st->ports, ud->out[0], ud->out[1]);
+	topo_take(topo_bus(st->dev), usbio_nsec());
+	if (serve_xfer(st->dev, buf) == -1) {
+		serve_fail(s, st->dev, s->next - 1);
+		return;
+	}
+
+	if (s->next == s->sq.n) {
+		printf("seq %d: done, %d steps\n", SERVE_HANDLE(s), s->sq.n);
+		fflush(stdout);
+		serve_unlink(s);
+		serve_release(s);
+		serve_switch(s);
+	}
+}
+
+static struct serve_seq *
+serve_find(int handle) {
+	struct serve_seq *s;
+
+	if ((handle & 0xff) >= SERVE_MAXSEQ)
+		return NULL;
+	s = &serve_seqs[handle & 0xff];
+	if (!s->used || SERVE_HANDLE(s) != handle)
+		return NULL;
+	return s;
+}
+
+static int
+serve_run(int prio, const char *path, char *reply) {
+	struct serve_seq *s, *old = serve_head;
+	int i;
+
+	for (i = 0; i < SERVE_MAXSEQ; i++)
+		if (!serve_seqs[i].used)
+			break;
+	if (i == SERVE_MAXSEQ)
+		return snprintf(reply, SERVE_MSGLEN, "error queue full");
+	s = &serve_seqs[i];
+	memset(s, 0, sizeof(*s));
+	if (seq_compile_file(&s->sq, path) == -1)
+		return snprintf(reply, SERVE_MSGLEN, "error %s: bad sequence",
+			path);
+	seq_sort(&s->sq);
+	for (i = 0; i < s->sq.n; i++)
+		if (s->sq.step[i].dev >= ndevs) {
+			seq_free(&s->sq);
+			return snprintf(reply, SERVE_MSGLEN,
+				"error %s: no device %d", path,
+				s->sq.step[i].dev);
+		}
+	if (s->sq.n == 0) {
+		seq_free(&s->sq);
+		return snprintf(reply, SERVE_MSGLEN, "error %s: empty", path);
+	}
+	s->val = calloc(ndevs, sizeof(*s->val));
+	s->known = calloc(ndevs, sizeof(*s->known));
+	if (s->val == NULL || s->known == NULL)
+		err(1, "calloc");
+	s->used = 1;
+	s->gen = serve_gen = (serve_gen + 1) & 0xffff;
+	s->prio = prio;
+	serve_link(s);
+	serve_switch(old);
+	return snprintf(reply, SERVE_MSGLEN, "ok %d%s", SERVE_HANDLE(s),
+		old != NULL && serve_head == s ? " preempted" : "");
+}
+
+static int
+serve_cancel(struct serve_seq *s, const char *safe, uint64_t t0,
+    char *reply) {
+	unsigned char buf[USBIO_REPORT_SIZE], sv[2];
+	struct serve_seq *old = serve_head;
+	uint64_t quiet;
+	char *ep;
+	int d, dropped = s->sq.n - s->next, failed = 0;
+
+	if (safe != NULL) {
+		if (strncmp(safe, "safe=", 5) != 0)
+			return snprintf(reply, SERVE_MSGLEN, "error %s", safe);
+		sv[0] = strtol(safe + 5, &ep, 16);
+		if (*ep != ':')
+			return snprintf(reply, SERVE_MSGLEN, "error %s", safe);
+		sv[1] = strtol(ep + 1, &ep, 16) & USBIO_PORT2_MASK;
+	}
+
+	serve_unlink(s);
+	if (safe != NULL)
+		for (d = 0; d < ndevs; d++) {
+			if ((s->known[d][0] | s->known[d][1]) == 0)
+				continue;
+			devs[d].out[0] = sv[0];
+			devs[d].out[1] = sv[1];
+			usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2, sv[0],
+				sv[1]);
+			if (serve_xfer(d, buf) == -1)
+				failed++;
+		}
+	quiet = usbio_nsec() - t0;
+	serve_release(s);
+	serve_switch(old);
+
+	serve_cancels++;
+	serve_quiet_sum += quiet;
+	if (quiet > serve_quiet_max)
+		serve_quiet_max = quiet;
+	return snprintf(reply, SERVE_MSGLEN, "ok %d dropped %d quiet %llu us"
+		" failed %d", SERVE_HANDLE(s), dropped,
+		(unsigned long long)quiet / 1000, failed);
+}
+
+/*
+ * tell the failure of s, then free its handle
+ */
+static int
+serve_failed(struct serve_seq *s, char *reply, size_t len) {
+	int n;
+
+	n = snprintf(reply, len, "%d failed at step %d/%d on device %d",
+		SERVE_HANDLE(s), s->failstep, s->sq.n, s->failed - 1);
+	serve_release(s);
+	return n;
+}
+
+static int
+serve_list(char *reply) {
+	struct serve_seq *s;
+	int i, n;
+
+	n = snprintf(reply, SERVE_MSGLEN, "ok");
+	for (s = serve_head; s != NULL && n < SERVE_MSGLEN; s = s->nxt)
+		n += snprintf(reply + n, SERVE_MSGLEN - n,
+			"\n%d prio %d step %d/%d%s", SERVE_HANDLE(s), s->prio,
+			s->next, s->sq.n, s == serve_head ? " running" :
+			s->paused ? " preempted" : "");
+	for (i = 0; i < SERVE_MAXSEQ && n < SERVE_MSGLEN; i++)
+		if (serve_seqs[i].used && serve_seqs[i].failed) {
+			n += snprintf(reply + n, SERVE_MSGLEN - n, "\n");
+			if (n < SERVE_MSGLEN)
+				n += serve_failed(&serve_seqs[i], reply + n,
+					SERVE_MSGLEN - n);
+		}
+	return n;
+}
+
+static void
+serve_addr(const char *path, struct sockaddr_un *sun) {
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+	    sizeof(sun->sun_path))
+		errx(1, "%s: name too long", path);
+}
+
+/*
+ * the controlling client has gone quiet
+ */
+static void
+serve_lapse(void) {
+	struct serve_seq *s;
+	uint64_t t0 = serve_hb;
+
+	serve_hb = 0;
+	while ((s = serve_head) != NULL) {
+		serve_unlink(s);
+		serve_release(s);
+	}
+	if (safe_apply("heartbeat lapse", t0) == 0)
+		fprintf(stderr, "heartbeat lapse: sequences cancelled,"
+			" no safe state (-Z)\n");
+}
+
+/*
+ * execute one command, t0 is when it was received
+ */
+static int
+serve_command(char *cmd, uint64_t t0, char *reply) {
+	struct serve_seq *s;
+	char *argv[4], *last;
+	int argc = 0, n;
+
+	for (argv[0] = strtok_r(cmd, " \t\n", &last); argv[argc] != NULL &&
+	    argc < 3; argv[++argc] = strtok_r(NULL, " \t\n", &last))
+		;
+	if (argc == 0)
+		return snprintf(reply, SERVE_MSGLEN, "error empty command");
+
+	if (strcmp(argv[0], "run") == 0 && argc == 3)
+		return serve_run(atoi(argv[1]), argv[2], reply);
+	if (strcmp(argv[0], "cancel") == 0 && argc >= 2) {
+		if ((s = serve_find(atoi(argv[1]))) == NULL)
+			return snprintf(reply, SERVE_MSGLEN,
+				"error no sequence %s", argv[1]);
+		if (s->failed) {
+			n = snprintf(reply, SERVE_MSGLEN, "error ");
+			return n + serve_failed(s, reply + n, SERVE_MSGLEN - n);
+		}
+		return serve_cancel(s, argc == 3 ? argv[2] : NULL, t0, reply);
+	}
+	if (strcmp(argv[0], "list") == 0)
+		return serve_list(reply);
+	if (strcmp(argv[0], "hb") == 0 && argc == 2) {
+		serve_hb = atoi(argv[1]) > 0 ?
+			t0 + atoi(argv[1]) * 1000000ULL : 0;
+		return snprintf(reply, SERVE_MSGLEN, "ok");
+	}
+	return snprintf(reply, SERVE_MSGLEN, "error bad command %s", argv[0]);
+}
+
+/*
+ * a datagram socket bound to path, also used by watchdog.c
+ */
+int
+serve_socket(const char *path) {
+	struct sockaddr_un sun;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1)
+		err(1, "socket");
+	serve_addr(path, &sun);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "%s", path);
+	return fd;
+}
+
+/*
+ * serve mode
+ */
+int
+serve_main(int fd, int argc, char *argv[]) {
+	struct sockaddr_un from;
+	struct pollfd pfd;
+	struct timespec ts, *tsp;
+	socklen_t fromlen;
+	char cmd[SERVE_MSGLEN], reply[SERVE_MSGLEN];
+	struct usbio_bus *buses;
+	uint64_t due, idle, now;
+	ssize_t len;
+	int n, ret;
+
+	if (opts.ctlsock == NULL)
+		errx(1, "serve: no control socket given (-S)");
+	pfd.fd = serve_socket(opts.ctlsock);
+	pfd.events = POLLIN;
+	printf("serving %d devices on %s\n", ndevs, opts.ctlsock);
+	fflush(stdout);
+	topo_build(&buses);
+	handle_init();
+
+	while (!interrupted) {
+		idle = handle_idle(usbio_nsec());
+		due = 0;
+		if (serve_head != NULL)
+			due = serve_due(serve_head);
+		if (serve_hb != 0 && (due == 0 || serve_hb < due))
+			due = serve_hb;
+		if (idle != 0 && (due == 0 || idle < due))
+			due = idle;
+		tsp = NULL;
+		if (due != 0) {
+			now = usbio_nsec();
+			due = due > now ? due - now : 0;
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			tsp = &ts;
+		}
+		ret = ppoll(&pfd, 1, tsp, NULL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "ppoll");
+		}
+		fromlen = sizeof(from);
+		if (ret > 0 && (len = recvfrom(pfd.fd, cmd, sizeof(cmd) - 1, 0,
+		    (struct sockaddr *)&from, &fromlen)) != -1) {
+			cmd[len] = '\0';
+			n = serve_command(cmd, usbio_nsec(), reply);
+			if (fromlen > sizeof(sa_family_t))
+				sendto(pfd.fd, reply, n < SERVE_MSGLEN ? n :
+					SERVE_MSGLEN - 1, 0,
+					(struct sockaddr *)&from, fromlen);
+		}
+
+		/* due work runs even while commands keep coming */
+		now = usbio_nsec();
+		if (serve_hb != 0 && now >= serve_hb)
+			serve_lapse();
+		else if (serve_head != NULL && now >= serve_due(serve_head))
+			serve_step(serve_head);
+	}
+
+	if (serve_cancels > 0)
+		printf("%d cancels, cancel-to-quiet us: avg %llu max %llu\n",
+			serve_cancels, (unsigned long long)serve_quiet_sum /
+			serve_cancels / 1000,
+			(unsigned long long)serve_quiet_max / 1000);
+	handle_report();
+	close(pfd.fd);
+	unlink(opts.ctlsock);
+	return 0;
+}
+
+/*
+ * ctl mode
+ *   argv: a command for the server at -S
+ */
+int
+ctl_main(int fd, int argc, char *argv[]) {
+	struct sockaddr_un sun;
+	struct pollfd pfd;
+	char msg[SERVE_MSGLEN], path[sizeof(sun.sun_path)];
+	char dir[] = "/tmp/usbioctl.XXXXXXXXXX";
+	ssize_t len;
+	int i, n = 0;
+
+	if (opts.ctlsock == NULL || argc == 0)
+		errx(1, "ctl: need -S and a command");
+	for (i = 0; i < argc && n < sizeof(msg); i++)
+		n += snprintf(msg + n, sizeof(msg) - n, "%s%s", i ? " " : "",
+			argv[i]);
+	if (n >= sizeof(msg))
+		errx(1, "ctl: command too long");
+
+	/*
+	 * the server replies to our own address, in a directory only we
+	 * can write to
+	 */
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/ctl", dir);
+	pfd.fd = serve_socket(path);
+	pfd.events = POLLIN;
+	serve_addr(opts.ctlsock, &sun);
+
+	if (sendto(pfd.fd, msg, n, 0, (struct sockaddr *)&sun,
+	    sizeof(sun)) == -1) {
+		unlink(path);
+		rmdir(dir);
+		err(1, "%s", opts.ctlsock);
+	}
+	len = -1;
+	if (poll(&pfd, 1, 2000) == 1)
+		len = recv(pfd.fd, msg, sizeof(msg) - 1, 0);
+	unlink(path);
+	rmdir(dir);
+	if (len == -1)
+		errx(1, "%s: no reply", opts.ctlsock);
+	msg[len] = '\0';
+	printf("%s\n", msg);
+	return strncmp(msg, "ok", 2) != 0;
+}
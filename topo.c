@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * topo.c: bus topology of the opened devices, and fan-out over it
+ *
+ * Devices on one bus (one host controller) share its frames: a burst of
+ * reports to a full hub delays every device of that bus, but not those
+ * on another controller.  topo_build() groups the opened devices by the
+ * bus found by usbio_check(), ordered by hub port and address.  With -r,
+ * each bus has a report budget of rate reports per second: a writer asks
+ * topo_next() when the next report to a bus may go and spends the budget
+ * with topo_take().  A bus has one writer at a time, so the budget needs
+ * no lock: -m plan plays each bus by its own thread, -m serve and
+ * -m fanout single are one thread for all buses.
+ *
+ * -m fanout sends reports to every device as fast as allowed, for -t
+ * seconds, with one writer thread per bus; each bus has its own report
+ * budget (-r reports per second, per bus).  "-m fanout single" uses one
+ * writer for all buses instead, as usbioctl did before, where a slow bus
+ * holds up the others.  The round trip times are reported per bus.
+ */
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), qsort(), reallocarray() */
+#include <string.h>	/* strcmp() */
+
+#include "usbio.h"
+
+#define TOPO_DEFAULT_TIME	2	/* seconds */
+
+struct topo_stat {
+	uint64_t	*rtt;
+	int		n, size;
+	uint64_t	next;		/* budget: earliest next report */
+};
+
+struct topo_writer {
+	int		ndevs;
+	int		*dev;		/* indices in devs[] */
+	pthread_t	thread;
+};
+
+static struct usbio_bus topo_buses[USBIO_MAXBUSES];
+static int topo_nbuses = 0;
+static int topo_busof[USBIO_MAXDEVS];	/* index in topo_buses[] */
+static struct topo_stat topo_stats[USBIO_MAXBUSES];
+static uint64_t topo_interval = 0;	/* ns between reports of a bus */
+static uint64_t topo_end;
+
+static int
+topo_cmp(const void *a, const void *b) {
+	const struct usbio_dev *x = &devs[*(const int *)a];
+	const struct usbio_dev *y = &devs[*(const int *)b];
+
+	if (x->bus != y->bus)
+		return x->bus - y->bus;
+	if (x->hubport != y->hubport)
+		return x->hubport - y->hubport;
+	return x->addr - y->addr;
+}
+
+/*
+ * group the opened devices by bus, and set the budget of -r
+ *   return the number of buses, the groups are in *buses
+ */
+int
+topo_build(struct usbio_bus **buses) {
+	static int order[USBIO_MAXDEVS];
+	struct usbio_bus *b = NULL;
+	int i, d;
+
+	for (i = 0; i < ndevs; i++)
+		order[i] = i;
+	qsort(order, ndevs, sizeof(order[0]), topo_cmp);
+
+	topo_nbuses = 0;
+	for (i = 0; i < ndevs; i++) {
+		d = order[i];
+		if (b == NULL || b->bus != devs[d].bus) {
+			if (topo_nbuses == USBIO_MAXBUSES)
+				errx(1, "more than %d buses", USBIO_MAXBUSES);
+			b = &topo_buses[topo_nbuses++];
+			b->bus = devs[d].bus;
+			b->ndevs = 0;
+			b->dev = &order[i];
+		}
+		b->ndevs++;
+		topo_busof[d] = b - topo_buses;
+	}
+	if (opts.rate > 0)
+		topo_interval = 1000000000ULL / opts.rate;
+	*buses = topo_buses;
+	return topo_nbuses;
+}
+
+/*
+ * the bus of an opened device, an index in the groups of topo_build()
+ */
+int
+topo_bus(int dev) {
+	return topo_busof[dev];
+}
+
+/*
+ * when may the next report go to a bus?  0: at once
+ */
+uint64_t
+topo_next(int bus) {
+	return topo_interval ? topo_stats[bus].next : 0;
+}
+
+/*
+ * a report goes to a bus now, spend its budget
+ */
+void
+topo_take(int bus, uint64_t now) {
+	struct topo_stat *st = &topo_stats[bus];
+
+	if (topo_interval != 0)
+		st->next = (st->next > now ? st->next : now) + topo_interval;
+}
+
+static void
+topo_record(struct topo_stat *st, uint64_t rtt) {
+	if (st->n == st->size) {
+		st->size = st->size ? st->size * 2 : 1024;
+		st->rtt = reallocarray(st->rtt, st->size, sizeof(*st->rtt));
+		if (st->rtt == NULL)
+			err(1, "reallocarray");
+	}
+	st->rtt[st->n++] = rtt;
+}
+
+/*
+ * wait for the report budget of a bus, and spend it
+ */
+static void
+topo_budget(int bus) {
+	uint64_t now = usbio_nsec();
+
+	if (topo_next(bus) > now)
+		usbio_sleep_until(topo_next(bus));
+	topo_take(bus, now);
+}
+
+/*
+ * a writer: a request to each of its devices, then the replies
+ */
+static void *
+topo_write(void *arg) {
+	struct topo_writer *w = arg;
+	struct usbio_dev *ud;
+	unsigned char buf[USBIO_REPORT_SIZE];
+	unsigned char *seq;
+	uint64_t *sent;
+	int i;
+
+	seq = calloc(w->ndevs, sizeof(*seq));
+	sent = calloc(w->ndevs, sizeof(*sent));
+	if (seq == NULL || sent == NULL)
+		err(1, "calloc");
+
+	while (!interrupted && usbio_nsec() < topo_end) {
+		for (i = 0; i < w->ndevs; i++) {
+			ud = &devs[w->dev[i]];
+			topo_budget(topo_busof[w->dev[i]]);
+			usbio_frame2(buf, 0, 0, 0);
+			seq[i] = buf[USBIO_SEQNO] = ud->seqno++;
+			sent[i] = usbio_nsec();
+			usbio_send2(ud->fd, buf);
+		}
+		for (i = 0; i < w->ndevs; i++) {
+			ud = &devs[w->dev[i]];
+			if (usbio_read2(ud->fd, seq[i], buf) == -1)
+				goto out;
+			topo_record(&topo_stats[topo_busof[w->dev[i]]],
+				usbio_nsec() - sent[i]);
+		}
+	}
+out:
+	free(seq);
+	free(sent);
+	return NULL;
+}
+
+static int
+topo_u64cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * fanout mode
+ *   argv: "bus" (default), one writer per bus, or "single"
+ */
+int
+fanout_main(int fd, int argc, char *argv[]) {
+	struct usbio_bus *buses;
+	struct topo_writer *w;
+	struct topo_stat *st;
+	uint64_t start, t;
+	int i, nb, nw, single = 0;
+
+	if (argc > 1 || (argc == 1 && strcmp(argv[0], "single") != 0 &&
+	    strcmp(argv[0], "bus") != 0))
+		errx(1, "fanout: bus or single");
+	if (argc == 1 && strcmp(argv[0], "single") == 0)
+		single = 1;
+
+	nb = topo_build(&buses);
+	for (i = 0; i < nb; i++)
+		printf("bus %d: %d devices\n", buses[i].bus, buses[i].ndevs);
+
+	nw = single ? 1 : nb;
+	w = calloc(nw, sizeof(*w));
+	if (w == NULL)
+		err(1, "calloc");
+	if (single) {
+		/* all devices, in bus order */
+		w[0].dev = buses[0].dev;
+		w[0].ndevs = ndevs;
+	} else
+		for (i = 0; i < nb; i++) {
+			w[i].dev = buses[i].dev;
+			w[i].ndevs = buses[i].ndevs;
+		}
+
+	start = usbio_nsec();
+	topo_end = start + (opts.duration > 0 ? opts.duration :
+		TOPO_DEFAULT_TIME) * 1000000000ULL;
+	for (i = 0; i < nw; i++)
+		if ((errno = pthread_create(&w[i].thread, NULL, topo_write,
+		    &w[i])) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < nw; i++)
+		pthread_join(w[i].thread, NULL);
+	t = usbio_nsec() - start;
+
+	printf("%s writer%s, budget %s\n", single ? "one" : "per bus",
+		single ? "" : "s", topo_interval ? "per bus" : "none");
+	for (i = 0; i < nb; i++) {
+		st = &topo_stats[i];
+		if (st->n == 0)
+			continue;
+		qsort(st->rtt, st->n, sizeof(*st->rtt), topo_u64cmp);
+		printf("bus %d: %d exchanges, %.1f/s, rtt us: p50 %llu"
+			" p99 %llu max %llu\n", buses[i].bus, st->n,
+			st->n * 1e9 / t,
+			(unsigned long long)st->rtt[st->n / 2] / 1000,
+			(unsigned long long)st->rtt[st->n * 99 / 100] / 1000,
+			(unsigned long long)st->rtt[st->n - 1] / 1000);
+		free(st->rtt);
+	}
+	free(w);
+	return 0;
+}
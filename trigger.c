@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * trigger.c: pre/post trigger windows of -m monitor
+ *
+ * With -X, the monitor keeps its samples, of all devices in the order
+ * they came, in a ring of the last pre samples instead of writing the
+ * changes.  When a sample meets the trigger, the ring (the pre trigger
+ * window) and the trigger sample are written, then the next post samples
+ * as they come; then the trigger is armed again, and a window never
+ * repeats a sample of the one before.  Windows go where the changes would
+ * have gone, to the capture file (-w) or the output.
+ *
+ * The trigger is "[dev:]port.bit=c,..." with c one of 0, 1 (levels), r,
+ * f (rising, falling edge) or e (either edge); edges are between the
+ * sample and the previous one of the same device.  The trigger fires when
+ * its conditions become true on a device, not again while levels hold.
+ * The conditions are compiled into pin masks, so testing a sample costs a
+ * few word operations however many pins the trigger has.
+ */
+
+#include <err.h>	/* err() */
+#include <stdio.h>
+#include <stdlib.h>	/* calloc(), strtol() */
+#include <string.h>	/* strchr(), strlcpy(), strncmp() */
+
+#include "usbio.h"
+
+#define TRIG_PRE	1000	/* default samples before the trigger */
+#define TRIG_POST	1000	/* and after */
+
+static int trig_on = 0;
+static int trig_dev = -1;		/* -1: any */
+static uint16_t trig_lmask = 0, trig_lval = 0;	/* levels */
+static uint16_t trig_rise = 0, trig_fall = 0, trig_edge = 0;
+static long trig_pre = TRIG_PRE, trig_post = TRIG_POST;
+
+static struct usbio_cap_rec *trig_ring = NULL;
+static uint64_t trig_mask;		/* of ring indices */
+static uint64_t trig_n = 0;		/* samples seen */
+static uint64_t trig_written = 0;	/* samples written, up to */
+static long trig_left = 0;		/* post samples to go, 0: armed */
+static uint64_t trig_fired = 0, trig_recs = 0;
+static unsigned char trig_was[USBIO_MAXDEVS];	/* met at the last sample */
+
+/*
+ * parse -X
+ */
+int
+trigger_parse(const char *spec) {
+	char buf[1024], *s, *ep, *last;
+	long dev, port, bit;
+	uint16_t pin;
+
+	strlcpy(buf, spec, sizeof(buf));
+	for (s = strtok_r(buf, ",", &last); s != NULL;
+	    s = strtok_r(NULL, ",", &last)) {
+		if (strncmp(s, "pre=", 4) == 0 ||
+		    strncmp(s, "post=", 5) == 0) {
+			bit = strtol(strchr(s, '=') + 1, &ep, 10);
+			if (*ep != '\0' || bit < 0)
+				return -1;
+			if (s[1] == 'r')
+				trig_pre = bit;
+			else
+				trig_post = bit;
+			continue;
+		}
+		dev = -1;
+		port = strtol(s, &ep, 10);
+		if (*ep == ':') {
+			dev = port;
+			port = strtol(ep + 1, &ep, 10);
+		}
+		if (*ep != '.')
+			return -1;
+		bit = strtol(ep + 1, &ep, 10);
+		if (ep[0] != '=' || ep[1] == '\0' || ep[2] != '\0' ||
+		    dev >= USBIO_MAXDEVS || (port != 1 && port != 2) ||
+		    bit < 0 || bit > (port == 1 ? 7 : 3))
+			return -1;
+		if (dev != -1) {
+			/* a sample is of one device */
+			if (trig_dev != -1 && trig_dev != dev)
+				return -1;
+			trig_dev = dev;
+		}
+		pin = 1 << ((port - 1) * 8 + bit);
+		switch (ep[1]) {
+		case '0':
+		case '1':
+			trig_lmask |= pin;
+			if (ep[1] == '1')
+				trig_lval |= pin;
+			break;
+		case 'r':
+			trig_rise |= pin;
+			break;
+		case 'f':
+			trig_fall |= pin;
+			break;
+		case 'e':
+			trig_edge |= pin;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if ((trig_lmask | trig_rise | trig_fall | trig_edge) == 0)
+		return -1;
+	trig_on = 1;
+	return 0;
+}
+
+/*
+ * is a trigger given?
+ */
+int
+trigger_on(void) {
+	return trig_on;
+}
+
+void
+trigger_init(void) {
+	uint64_t size;
+
+	if (!trig_on)
+		return;
+	for (size = 1; size < (uint64_t)trig_pre + 1; size <<= 1)
+		;
+	if ((trig_ring = calloc(size, sizeof(*trig_ring))) == NULL)
+		err(1, "calloc");
+	trig_mask = size - 1;
+}
+
+static int
+trigger_match(const struct usbio_cap_rec *rec) {
+	uint16_t p = rec->pins, c = rec->changed;
+
+	return ((p ^ trig_lval) & trig_lmask) == 0 &&
+		(trig_rise & ~(c & p)) == 0 &&
+		(trig_fall & ~(c & ~p)) == 0 &&
+		(trig_edge & ~c) == 0 &&
+		(trig_dev == -1 || rec->dev == trig_dev);
+}
+
+/*
+ * a sample came, called by the monitor for every sample
+ */
+void
+trigger_sample(const struct usbio_cap_rec *rec) {
+	uint64_t i;
+	int met, was;
+
+	met = trigger_match(rec);
+	was = trig_was[rec->dev];
+	trig_was[rec->dev] = met;
+	if (trig_left > 0) {
+		input_record(rec);
+		trig_written = ++trig_n;
+		trig_recs++;
+		trig_left--;
+		return;
+	}
+	trig_ring[trig_n++ & trig_mask] = *rec;
+	if (!met || was)
+		return;
+
+	/* freeze the pre trigger window: write it with the trigger */
+	i = trig_n > (uint64_t)trig_pre + 1 ? trig_n - trig_pre - 1 : 0;
+	if (i < trig_written)
+		i = trig_written;
+	for (; i < trig_n; i++) {
+		input_record(&trig_ring[i & trig_mask]);
+		trig_recs++;
+	}
+	trig_written = trig_n;
+	trig_left = trig_post;
+	trig_fired++;
+	DPRINTF("trigger: dev %d at %llu\n", rec->dev,
+		(unsigned long long)rec->t);
+}
+
+void
+trigger_report(void) {
+	if (!trig_on)
+		return;
+	printf("trigger: %llu windows, %llu of %llu samples written%s\n",
+		(unsigned long long)trig_fired, (unsigned long long)trig_recs,
+		(unsigned long long)trig_n,
+		trig_left > 0 ? ", the last one cut short" : "");
+	free(trig_ring);
+	trig_ring = NULL;
+}
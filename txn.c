@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * txn.c: transactional updates across ports and devices
+ *
+ * A transaction stages new values for any port of any opened device and
+ * commits them in at most two phases:
+ *   phase 1: bits which must be cleared first are cleared
+ *   phase 2: every port gets its target value
+ * Phase 2 is not started before all phase 1 replies have come back.
+ * Which clears go first is decided by the constraints:
+ *   "clear"           every clear in the transaction, on any device,
+ *                     lands before any set (clear before set)
+ *   "bbm=PIN+PIN..."  pins of the group are never on together, a clear
+ *                     in the group goes first when the transaction also
+ *                     sets a pin of the group (break before make); a
+ *                     transaction which leaves two of them on is refused
+ * where PIN is [dev:]port.bit.  Both ports of a device are written by a
+ * single report, so a commit needs one report per device and phase, and
+ * a single phase when no constraint asks for ordering.
+ */
+
+#include <err.h>	/* errx() */
+#include <stdio.h>
+#include <stdlib.h>	/* strtol() */
+#include <string.h>	/* memset(), strncmp(), strtok() */
+
+#include "usbio.h"
+
+#define TXN_MAXGROUPS	16
+
+struct txn_group {
+	unsigned char	pins[USBIO_MAXDEVS][2];
+};
+
+static int txn_clear_first = 0;
+static struct txn_group txn_groups[TXN_MAXGROUPS];
+static int txn_ngroups = 0;
+
+/*
+ * parse "[dev:]port", return the end of it
+ */
+static char *
+txn_port(char *s, int *dev, int *port) {
+	char *ep;
+	long n;
+
+	*dev = 0;
+	n = strtol(s, &ep, 10);
+	if (*ep == ':') {
+		*dev = (int)n;
+		n = strtol(ep + 1, &ep, 10);
+	}
+	*port = (int)n;
+	if (*dev < 0 || *dev >= ndevs || (*port != 1 && *port != 2))
+		return NULL;
+	return ep;
+}
+
+/*
+ * add a constraint given by -C
+ */
+int
+txn_constraint(const char *spec) {
+	struct txn_group *g;
+	char buf[256], *s, *ep;
+	int dev, port, bit;
+
+	if (strcmp(spec, "clear") == 0) {
+		txn_clear_first = 1;
+		return 0;
+	}
+	if (strncmp(spec, "bbm=", 4) != 0 || txn_ngroups == TXN_MAXGROUPS)
+		return -1;
+
+	g = &txn_groups[txn_ngroups];
+	memset(g, 0, sizeof(*g));
+	strlcpy(buf, spec + 4, sizeof(buf));
+	for (s = strtok(buf, "+"); s != NULL; s = strtok(NULL, "+")) {
+		/* devices are opened later, absent ones never match */
+		dev = 0;
+		port = (int)strtol(s, &ep, 10);
+		if (*ep == ':') {
+			dev = port;
+			port = (int)strtol(ep + 1, &ep, 10);
+		}
+		if (*ep != '.')
+			return -1;
+		bit = (int)strtol(ep + 1, &ep, 10);
+		if (*ep != '\0' || dev < 0 || dev >= USBIO_MAXDEVS ||
+		    (port != 1 && port != 2) || bit < 0 ||
+		    bit > (port == 1 ? 7 : 3))
+			return -1;
+		g->pins[dev][port - 1] |= 1 << bit;
+	}
+	txn_ngroups++;
+	return 0;
+}
+
+/*
+ * stage a transaction "[dev:]port=value[/mask],..." into tgt
+ */
+static int
+txn_parse(char *spec, unsigned char tgt[][2]) {
+	char buf[1024], *s, *ep;
+	int dev, port;
+	long val, mask;
+
+	strlcpy(buf, spec, sizeof(buf));
+	for (s = strtok(buf, ","); s != NULL; s = strtok(NULL, ",")) {
+		ep = txn_port(s, &dev, &port);
+		if (ep == NULL || *ep != '=')
+			return -1;
+		val = strtol(ep + 1, &ep, 16);
+		mask = 0xff;
+		if (*ep == '/')
+			mask = strtol(ep + 1, &ep, 16);
+		if (*ep != '\0' || val < 0 || val > 0xff ||
+		    mask < 0 || mask > 0xff)
+			return -1;
+		tgt[dev][port - 1] = (tgt[dev][port - 1] & ~mask) |
+			(val & mask);
+		if (port == 2)
+			tgt[dev][1] &= USBIO_PORT2_MASK;
+	}
+	return 0;
+}
+
+/*
+ * send one report to each device whose value changes, then collect
+ * all replies; return the number of reports, -1 if a reply is missing
+ */
+static int
+txn_phase(unsigned char val[][2]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	unsigned char seq[USBIO_MAXDEVS];
+	int sent[USBIO_MAXDEVS];
+	int d, ports, n = 0, ret = 0;
+
+	for (d = 0; d < ndevs; d++) {
+		ports = 0;
+		if (val[d][0] != devs[d].out[0])
+			ports |= USBIO_PORT1;
+		if (val[d][1] != devs[d].out[1])
+			ports |= USBIO_PORT2;
+		if (ports == 0) {
+			sent[d] = 0;
+			continue;
+		}
+		usbio_frame2(buf, ports, val[d][0], val[d][1]);
+		buf[USBIO_SEQNO] = seqno;
+		usbio_send2(devs[d].fd, buf);
+		sent[d] = 1;
+		seq[d] = seqno++;
+		devs[d].out[0] = val[d][0];
+		devs[d].out[1] = val[d][1];
+		n++;
+	}
+	/* all writes are out, now wait for each of them */
+	for (d = 0; d < ndevs; d++)
+		if (sent[d] && usbio_read2(devs[d].fd, seq[d], buf) == -1) {
+			fprintf(stderr, "txn: no reply from device %d\n", d);
+			ret = -1;
+		}
+	return ret == -1 ? -1 : n;
+}
+
+/*
+ * check that no group of -C bbm= has more than one pin on in tgt
+ *   return the group, -1 if none
+ */
+static int
+txn_check(unsigned char tgt[][2]) {
+	unsigned char on;
+	int d, p, g, n;
+
+	for (g = 0; g < txn_ngroups; g++) {
+		n = 0;
+		for (d = 0; d < ndevs; d++)
+			for (p = 0; p < 2; p++)
+				for (on = txn_groups[g].pins[d][p] & tgt[d][p];
+				    on != 0; on &= on - 1)
+					n++;
+		if (n > 1)
+			return g;
+	}
+	return -1;
+}
+
+/*
+ * commit a staged transaction
+ *   return the number of reports, -1 if a phase did not complete or
+ *   a bbm group would have more than one pin on
+ */
+static int
+txn_commit(unsigned char tgt[][2], int *phases) {
+	unsigned char first[USBIO_MAXDEVS][2];
+	unsigned char clr, set, early;
+	int d, p, g, gd, gp, need = 0, any_set = 0, n = 0, ret;
+
+	if ((g = txn_check(tgt)) != -1) {
+		fprintf(stderr, "txn: more than one pin of bbm group %d on\n",
+			g);
+		return -1;
+	}
+
+	/* a clear is only worth ordering when something gets set */
+	for (d = 0; d < ndevs; d++)
+		for (p = 0; p < 2; p++)
+			if (tgt[d][p] & ~devs[d].out[p])
+				any_set = 1;
+
+	for (d = 0; d < ndevs; d++)
+		for (p = 0; p < 2; p++) {
+			clr = devs[d].out[p] & ~tgt[d][p];
+			early = txn_clear_first && any_set ? clr : 0;
+			for (g = 0; g < txn_ngroups; g++) {
+				/* does this transaction make a pin of g? */
+				set = 0;
+				for (gd = 0; gd < ndevs; gd++)
+					for (gp = 0; gp < 2; gp++)
+						set |= tgt[gd][gp] &
+						    ~devs[gd].out[gp] &
+						    txn_groups[g].pins[gd][gp];
+				if (set)
+					early |= clr & txn_groups[g].pins[d][p];
+			}
+			first[d][p] = devs[d].out[p] & ~early;
+			if (early)
+				need = 1;
+		}
+
+	*phases = 1;
+	if (need) {
+		/* phase 2 waits for every phase 1 reply */
+		if ((n = txn_phase(first)) == -1)
+			return -1;
+		(*phases)++;
+	}
+	if ((ret = txn_phase(tgt)) == -1)
+		return -1;
+	return n + ret;
+}
+
+/*
+ * txn mode
+ *   argv: transactions, each "[dev:]port=value[/mask],..."
+ *   device numbers follow the order of -f options
+ */
+int
+txn_main(int fd, int argc, char *argv[]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	unsigned char tgt[USBIO_MAXDEVS][2];
+	uint64_t t, lat, lat_sum = 0, lat_min = 0, lat_max = 0;
+	int d, i, n, phases, reports = 0;
+
+	/* the current port state is the starting point */
+	for (d = 0; d < ndevs; d++) {
+		usbio_frame2(buf, 0, 0, 0);
+		if (usbio_xfer2(devs[d].fd, buf) == -1)
+			errx(1, "txn: %s: no reply", devs[d].path);
+		devs[d].out[0] = buf[USBIO_REPLY_PORT1];
+		devs[d].out[1] = buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK;
+		devs[d].known = 1;
+	}
+
+	for (i = 0; i < argc && !interrupted; i++) {
+		for (d = 0; d < ndevs; d++) {
+			tgt[d][0] = devs[d].out[0];
+			tgt[d][1] = devs[d].out[1];
+		}
+		if (txn_parse(argv[i], tgt) == -1) {
+			fprintf(stderr, "txn: bad transaction %s\n", argv[i]);
+			return 1;
+		}
+
+		t = usbio_nsec();
+		n = txn_commit(tgt, &phases);
+		lat = usbio_nsec() - t;
+		if (n == -1) {
+			fprintf(stderr, "txn %d: not committed\n", i);
+			return 1;
+		}
+
+		printf("txn %d: %d reports, %d phases, %llu us\n",
+			i, n, phases, (unsigned long long)lat / 1000);
+		reports += n;
+		lat_sum += lat;
+		if (i == 0 || lat < lat_min)
+			lat_min = lat;
+		if (lat > lat_max)
+			lat_max = lat;
+	}
+
+	if (i > 0)
+		printf("%d transactions, %d reports, commit latency us:"
+			" min %llu avg %llu max %llu\n", i, reports,
+			(unsigned long long)lat_min / 1000,
+			(unsigned long long)lat_sum / i / 1000,
+			(unsigned long long)lat_max / 1000);
+	return 0;
+}
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usbio.c: USB-IO device access
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <fcntl.h>	/* open() */
+#include <pthread.h>	/* pthread_rwlock_rdlock() */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>	/* exit(), strtol() */
+#include <string.h>	/* memset(), strlcpy(), strncmp() */
+#include <time.h>	/* nanosleep() */
+#include <unistd.h>	/* close(), read(), write() */
+
+#include <dev/usb/usb.h>
+
+#include "usbio.h"
+
+/* USB-IO vendor and product ID */
+struct {
+	uint16_t	vendor;
+	uint16_t	product;
+	int		protocol_version;	/* 1 or 2 */
+} usbio_models [] = {
+#if 0	/* not supported yet */
+	0x0bfe, 0x1003, 1,	/* Morphy Planning USB-IO 1.0 */
+	0x1352, 0x0100, 1,	/* Km2Net USB-IO 1.0 */
+#endif
+	0x1352, 0x0120, 2,	/* Km2Net USB-IO 2.0 */
+	0x1352, 0x0121, 2,	/* Km2Net USB-IO 2.0(AKI) */
+};
+
+/* global variables */
+unsigned char seqno = 0;
+static FILE *tracefp = NULL;
+/* held while writing a report, taken for good by usbio_stop() */
+static pthread_rwlock_t usbio_wlock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile sig_atomic_t usbio_stopped = 0;
+const char *usbio_devdir = USBIO_DEVDIR;
+int usbio_debug = 0;
+struct usbio_verify verify;
+
+/*
+ * check vendor/product IDs on an opened file descriptor
+ *   return its protocol version (currently 2 only) if found
+ *   return -1 if not found, or if it can not be asked; this never
+ *   exits, safe.c opens devices from an atexit() handler
+ *   the identity of the device is stored in ud, unless it is NULL
+ */
+int
+usbio_check(int fd, struct usbio_dev *ud) {
+	int i;
+	int n = sizeof(usbio_models) / sizeof(usbio_models[0]);
+	struct usb_device_info udi;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (S_ISSOCK(st.st_mode)) {
+		/* a busy or dead usbiosim board, skipped like a busy uhid */
+		if (usbio_sim_info(fd, &udi) == -1)
+			return -1;
+	} else if (ioctl(fd, USB_GET_DEVICEINFO, &udi) == -1)
+		return -1;
+
+	DPRINTF("Vendor:0x%04x, Product:0x%04x, Release:0x%04x\n",
+		udi.udi_vendorNo, udi.udi_productNo, udi.udi_releaseNo);
+
+	if (ud != NULL) {
+		ud->vendor = udi.udi_vendorNo;
+		ud->product = udi.udi_productNo;
+		ud->bus = udi.udi_bus;
+		ud->addr = udi.udi_addr;
+		ud->hubport = udi.udi_port;
+		strlcpy(ud->serial, udi.udi_serial, sizeof(ud->serial));
+	}
+
+	for (i = 0; i < n; i++)
+		if ((udi.udi_vendorNo == usbio_models[i].vendor) &&
+			(udi.udi_productNo == usbio_models[i].product))
+				return usbio_models[i].protocol_version;
+
+	return -1;	/* not match */
+}
+
+/*
+ * get device information from usbiosim, which sends it on connect
+ */
+int
+usbio_sim_info(int fd, struct usb_device_info *udi) {
+	struct usbio_simid id;
+
+	if (read(fd, &id, sizeof(id)) != sizeof(id) ||
+	    id.magic != USBIO_SIM_MAGIC) {
+		errno = ENOTTY;
+		return -1;
+	}
+	memset(udi, 0, sizeof(*udi));
+	udi->udi_vendorNo = id.vendor;
+	udi->udi_productNo = id.product;
+	udi->udi_releaseNo = id.release;
+	udi->udi_bus = id.bus;
+	udi->udi_addr = id.addr;
+	udi->udi_port = id.port;
+	strlcpy(udi->udi_serial, id.serial, sizeof(udi->udi_serial));
+	return 0;
+}
+
+/*
+ * open a device node, or connect to a device simulated by usbiosim
+ */
+static int
+usbio_node(const char *devname) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (stat(devname, &st) == -1 || !S_ISSOCK(st.st_mode))
+		return open(devname, O_RDWR);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, devname, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		return -1;
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * open specified device name, and check
+ *   if ud is not NULL, the device is recorded there
+ */
+int
+usbio_open(const char *devname, struct usbio_dev *ud) {
+	int fd;
+
+	fd = usbio_node(devname);
+	if (fd != -1) {
+		if (usbio_check(fd, ud) != -1) {
+			if (ud != NULL) {
+				ud->fd = fd;
+				if (ud->path != devname)
+					strlcpy(ud->path, devname,
+						sizeof(ud->path));
+			}
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * look up an USB-IO device and open it
+ *   the device found last time is tried first, see ident.c
+ *   return file descriptor if found
+ */
+int
+usbio_lookup(struct usbio_dev *ud) {
+	int fd;
+
+	fd = usbio_select(NULL, ud);
+	if (fd != -1)
+		return fd;
+
+	/* exit if we can not find */
+	fprintf(stderr, "can not find/open USB-IO device\n");
+	exit(1);
+}
+
+/*
+ * open every USB-IO device found, appending them to devs[]
+ *   the scan stops at the first missing device node
+ *   return the number of devices opened
+ */
+int
+usbio_lookup_all(void) {
+	struct rlimit rl;
+	struct stat st;
+	int i, fd, n = 0;
+	char devname[256];
+
+	/* one descriptor per device, a farm of simulated ones needs more */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	for (i = 0; ndevs < USBIO_MAXDEVS; i++) {
+		snprintf(devname, sizeof(devname), "%s/uhid%d", usbio_devdir,
+			i);
+		if (stat(devname, &st) == -1)
+			break;
+		fd = usbio_open(devname, &devs[ndevs]);
+		if (fd == -1)
+			continue;
+		ndevs++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * parse a verify strategy, "none", "all", "change" or a number N
+ * (every Nth write), optionally followed by ":retries"
+ */
+int
+usbio_verify_parse(const char *spec) {
+	char *ep;
+	long n;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.retries = USBIO_VERIFY_RETRIES;
+	if (strncmp(spec, "none", 4) == 0) {
+		verify.strategy = USBIO_VERIFY_NONE;
+		ep = (char *)spec + 4;
+	} else if (strncmp(spec, "all", 3) == 0) {
+		verify.strategy = USBIO_VERIFY_ALL;
+		ep = (char *)spec + 3;
+	} else if (strncmp(spec, "change", 6) == 0) {
+		verify.strategy = USBIO_VERIFY_CHANGE;
+		ep = (char *)spec + 6;
+	} else {
+		n = strtol(spec, &ep, 10);
+		if (ep == spec || n < 1)
+			return -1;
+		verify.strategy = USBIO_VERIFY_NTH;
+		verify.nth = (int)n;
+	}
+	if (*ep == ':') {
+		n = strtol(ep + 1, &ep, 10);
+		if (n < 0)
+			return -1;
+		verify.retries = (int)n;
+	}
+	return *ep == '\0' ? 0 : -1;
+}
+
+/*
+ * is this write to be verified?
+ */
+static int
+usbio_verify_due(int port, unsigned char data) {
+	int due = 0;
+
+	switch (verify.strategy) {
+	case USBIO_VERIFY_ALL:
+		due = 1;
+		break;
+	case USBIO_VERIFY_NTH:
+		due = (verify.writes % verify.nth) == 0;
+		break;
+	case USBIO_VERIFY_CHANGE:
+		due = !verify.valid[port] || verify.last[port] != data;
+		break;
+	}
+	verify.last[port] = data;
+	verify.valid[port] = 1;
+	verify.writes++;
+	return due;
+}
+
+/*
+ * print verification statistics
+ */
+void
+usbio_verify_report(void) {
+	if (verify.strategy == USBIO_VERIFY_NONE)
+		return;
+	printf("verify: writes %llu, checked %llu, mismatches %llu,"
+		" retries %llu, failed %llu, %llu us/check\n",
+		(unsigned long long)verify.writes,
+		(unsigned long long)verify.checked,
+		(unsigned long long)verify.mismatches,
+		(unsigned long long)verify.retried,
+		(unsigned long long)verify.failed,
+		(unsigned long long)(verify.checked ?
+		verify.ns / verify.checked / 1000 : 0));
+}
+
+/*
+ * record all traffic into a trace file
+ */
+int
+usbio_trace_open(const char *path) {
+	tracefp = fopen(path, "w");
+	return tracefp == NULL ? -1 : 0;
+}
+
+static void
+usbio_trace(int fd, int dir, unsigned char *buf) {
+	struct usbio_trace_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.t = usbio_nsec();
+	rec.dev = (uint16_t)fd;
+	rec.dir = (uint8_t)dir;
+	memcpy(rec.buf, buf, USBIO_REPORT_SIZE);
+	fwrite(&rec, sizeof(rec), 1, tracefp);
+}
+
+/*
+ * stop the writers of all threads: when this returns, no report is being
+ * written by usbio_send2() and none will be, its callers block or return
+ * without writing
+ */
+void
+usbio_stop(void) {
+	usbio_stopped = 1;
+	pthread_rwlock_wrlock(&usbio_wlock);
+}
+
+/*
+ * write a request
+ *   return -1 on an error
+ */
+static int
+usbio_put2(int fd, unsigned char *buf) {
+	int ret;
+
+	pthread_rwlock_rdlock(&usbio_wlock);
+	if (usbio_stopped) {
+		pthread_rwlock_unlock(&usbio_wlock);
+		return 0;
+	}
+	ret = write(fd, buf, USBIO_REPORT_SIZE);
+	pthread_rwlock_unlock(&usbio_wlock);
+	if (ret == -1)
+		return -1;
+	wear_write(fd, buf);
+	if (tracefp != NULL)
+		usbio_trace(fd, USBIO_TRACE_WRITE, buf);
+	return ret;
+}
+
+/*
+ * read the reply with sequence number seq
+ *   return the number of reports read, 0 on EOF, -1 on an error
+ */
+static int
+usbio_get2(int fd, unsigned char seq, unsigned char *buf) {
+	int ret, count;
+
+	count = 0;
+	for(;;) {
+		ret = read(fd, buf, 64);
+		count++;
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			return 0;
+		if (tracefp != NULL)
+			usbio_trace(fd, USBIO_TRACE_READ, buf);
+		if (input_match(buf, seq))
+			break;
+	}
+	return count;
+}
+
+/*
+ * send a request, its sequence number has to be set by the caller
+ */
+int
+usbio_send2(int fd, unsigned char *buf) {
+	int ret;
+
+	if ((ret = usbio_put2(fd, buf)) == -1)
+		err(1, "write");
+	return ret;
+}
+
+/*
+ * read the reply of a request with sequence number seq,
+ * replies of earlier requests, if any, are discarded
+ */
+int
+usbio_read2(int fd, unsigned char seq, unsigned char *buf) {
+	int ret;
+
+	if ((ret = usbio_get2(fd, seq, buf)) == -1)
+		err(1, "read");
+	return ret == 0 ? -1 : ret;
+}
+
+/*
+ * write: protocol version 2
+ *   if the verify strategy selects this write, the port state in the
+ *   reply is compared with the written value, and the write is retried
+ *   on mismatch; return -1 if it still does not match
+ */
+int
+usbio_write2(int fd, int port, unsigned char *data) {
+	int ret, count, retry, due;
+	unsigned char buf[64], mask;
+	uint64_t t;
+
+	due = usbio_verify_due(port, *data);
+	mask = (port == 2) ? USBIO_PORT2_MASK : 0xff;
+
+	for (retry = 0; ; retry++) {
+		memset(buf, 0x00, sizeof(buf));
+		buf[0] = USBIO2_RW;
+		buf[1] = (unsigned char)port;
+		buf[2] = *data;
+		buf[63] = seqno;
+
+		ret = usbio_send2(fd, buf);
+		if (ret != 0) {
+			DPRINTF("write: %02x:%02x %02x %02x %02x"
+				" %02x %02x %02x %02x:%02x\n",
+				buf[0], buf[1], buf[2], buf[3], buf[4],
+				buf[5], buf[6], buf[7], buf[8], buf[63]);
+		}
+		if (!due) {
+			seqno++;
+			return ret;
+		}
+
+		t = usbio_nsec();
+		count = usbio_read2(fd, seqno, buf);
+		verify.ns += usbio_nsec() - t;
+		verify.checked++;
+		seqno++;
+		if (count == -1)
+			break;
+		DPRINTF("read : %02x:%02x %02x %02x %02x"
+			" %02x %02x %02x %02x:%02x\n",
+			buf[0], buf[1], buf[2], buf[3], buf[4],
+			buf[5], buf[6], buf[7], buf[8], buf[63]);
+		DPRINTF("read : count = %d\n", count);
+
+		/* reply: [1] port 1, [2] port 2 */
+		if ((buf[port] & mask) == (*data & mask))
+			return ret;
+		verify.mismatches++;
+		if (retry == verify.retries)
+			break;
+		verify.retried++;
+	}
+
+	verify.failed++;
+	fprintf(stderr, "verify: port %d: wrote %02x, read %02x\n",
+		port, *data & mask, buf[port] & mask);
+	return -1;
+}
+
+/*
+ * build an USBIO2_RW request
+ *   ports: bitmap of ports to be written (USBIO_PORT1, USBIO_PORT2),
+ *   0 makes a request which only samples the pins
+ */
+void
+usbio_frame2(unsigned char *buf, int ports, unsigned char p1,
+	unsigned char p2) {
+	int i = 1;
+
+	memset(buf, 0x00, USBIO_REPORT_SIZE);
+	buf[0] = USBIO2_RW;
+	if (ports & USBIO_PORT1) {
+		buf[i++] = 1;
+		buf[i++] = p1;
+	}
+	if (ports & USBIO_PORT2) {
+		buf[i++] = 2;
+		buf[i++] = p2 & USBIO_PORT2_MASK;
+	}
+}
+
+/*
+ * exchange: protocol version 2
+ *   send a request built by usbio_frame2() and wait for its reply,
+ *   the reply is returned in buf
+ */
+int
+usbio_xfer2(int fd, unsigned char *buf) {
+	unsigned char sent = seqno++;
+
+	buf[USBIO_SEQNO] = sent;
+	usbio_send2(fd, buf);
+	return usbio_read2(fd, sent, buf) == -1 ? -1 : 0;
+}
+
+/*
+ * exchange like usbio_xfer2(), but an I/O error does not exit: for a
+ * device that may go away while others are still served
+ *   return -1 if the request is not acknowledged
+ */
+int
+usbio_try2(int fd, unsigned char *buf) {
+	unsigned char sent = seqno++;
+
+	buf[USBIO_SEQNO] = sent;
+	if (usbio_put2(fd, buf) == -1)
+		return -1;
+	return usbio_get2(fd, sent, buf) > 0 ? 0 : -1;
+}
+
+/*
+ * parse a value given on the command line, in hex
+ *   return -1 if it is out of range
+ */
+int
+usbio_value(const char *s) {
+	long val = strtol(s, NULL, 16);
+
+	return (val < 0 || val > 255) ? -1 : (int)val;
+}
+
+/*
+ * sleep until the monotonic clock reaches deadline (in nanoseconds)
+ */
+void
+usbio_sleep_until(uint64_t deadline) {
+	struct timespec ts;
+	uint64_t now;
+
+	while ((now = usbio_nsec()) < deadline && !interrupted) {
+		ts.tv_sec = (deadline - now) / 1000000000;
+		ts.tv_nsec = (deadline - now) % 1000000000;
+		nanosleep(&ts, NULL);
+	}
+}
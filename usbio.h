@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usbio.h: common definitions for usbioctl modules
+ */
+
+#ifndef _USBIO_H_
+#define _USBIO_H_
+
+#include <signal.h>	/* sig_atomic_t */
+#include <stdint.h>
+#include <stdio.h>	/* FILE */
+
+struct usb_device_info;
+
+#define	DEFAULT_PORT	2
+
+/* where uhid device nodes are looked up, see -D */
+#define USBIO_DEVDIR	"/dev"
+
+/*
+ * USB-IO(2.0) commands (not complete list)
+ */
+#define USBIO2_RW		0x20
+
+#define USBIO_PORT2_MASK	0x0f
+
+/*
+ * USB-IO(2.0) report layout of USBIO2_RW
+ *   request: [1] port number, [2] value, [3] port number, [4] value
+ *            port number 0 ends the list, so an empty list just samples
+ *   reply:   [1] port 1 pin state, [2] port 2 pin state
+ *   [63] is a sequence number, echoed back in the reply
+ */
+#define USBIO_REPORT_SIZE	64
+#define USBIO_SEQNO		63
+#define USBIO_REPLY_PORT1	1
+#define USBIO_REPLY_PORT2	2
+
+/* port bitmap for usbio_frame2() */
+#define USBIO_PORT1		0x01
+#define USBIO_PORT2		0x02
+
+/* compiled in, printed with -d only */
+#define DEBUG
+#ifdef DEBUG
+#define DPRINTF(...)	do { if (usbio_debug) fprintf(stderr, __VA_ARGS__); } \
+			while (0)
+#else
+#define DPRINTF(...)
+#endif
+
+/*
+ * usbiosim(1) devices are unix domain sockets (SOCK_SEQPACKET, so that
+ * 64 byte reports keep their boundaries).  On connect the simulator
+ * sends this in place of what USB_GET_DEVICEINFO returns.
+ */
+#define USBIO_SIM_MAGIC		0x55494f53	/* "UIOS" */
+
+struct usbio_simid {
+	uint32_t	magic;
+	uint16_t	vendor;
+	uint16_t	product;
+	uint16_t	release;
+	uint8_t		bus;
+	uint8_t		addr;
+	uint8_t		port;
+	char		serial[32];
+};
+
+/*
+ * traffic trace written by -T: every report sent and received,
+ * timestamped, in host byte order
+ */
+#define USBIO_TRACE_WRITE	'W'
+#define USBIO_TRACE_READ	'R'
+
+struct usbio_trace_rec {
+	uint64_t	t;		/* monotonic, ns */
+	uint16_t	dev;		/* file descriptor of the device */
+	uint8_t		dir;		/* USBIO_TRACE_WRITE or _READ */
+	uint8_t		pad[5];
+	unsigned char	buf[USBIO_REPORT_SIZE];
+};
+
+/*
+ * input capture written by -m monitor -w, see capture.c: a header, then
+ * blocks of a summary and records, a record for the first sample of each
+ * device and for every change, in host byte order; pins are numbered as
+ * in count.c, port 1 in bits 0-7 and port 2 in bits 8-11
+ */
+#define USBIO_CAP_MAGIC		0x55494f43	/* "UIOC" */
+#define USBIO_CAP_BLK_MAGIC	0x55494f42	/* "UIOB" */
+#define USBIO_CAP_VERSION	2
+#define USBIO_CAP_BLOCK		65536
+#define USBIO_CAP_KNOWN		0x8000		/* in state[]: pins valid */
+
+struct usbio_cap_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	ndevs;
+	uint32_t	blksize;	/* USBIO_CAP_BLOCK */
+	uint32_t	pad;
+	uint64_t	t0;		/* monotonic, ns, at the start */
+	uint64_t	t0_real;	/* CLOCK_REALTIME at t0 */
+};
+
+struct usbio_cap_blk {
+	uint32_t	magic;
+	uint32_t	nrecs;
+	uint64_t	t_first;	/* of its first record */
+	uint64_t	t_last;
+	uint16_t	changed;	/* pins changed by any record */
+	uint16_t	ndevs;
+	uint32_t	pad;
+	uint16_t	state[];	/* pins of each device at the start */
+};
+
+struct usbio_cap_rec {
+	uint64_t	t;		/* monotonic, ns */
+	uint16_t	dev;		/* index in devs[] */
+	uint16_t	pins;		/* port 1 | port 2 << 8 */
+	uint16_t	changed;	/* pins changed, 0 on the first */
+	uint16_t	pad;
+};
+
+/* capture being written */
+struct usbio_capw {
+	FILE		*fp;
+	const char	*path;
+	int		ndevs;
+	size_t		recoff;		/* of the records in a block */
+	int		nrecs, maxrecs;
+	unsigned char	*blk;		/* block being filled */
+	uint16_t	*state;		/* pins of each device, now */
+};
+
+/* capture mapped for reading */
+struct usbio_capr {
+	const unsigned char *base;
+	size_t		size;
+	const struct usbio_cap_hdr *hdr;
+	size_t		recoff;
+	uint32_t	nblocks;
+};
+
+/*
+ * latency profile of a device, fitted from traces by usbiosim -F
+ *   first: a request to a device idle for longer than idle
+ *   rtt:   a request to a device with nothing outstanding
+ *   burst: service time of a request queued behind another one
+ * each distribution is given by its 0, 10, ..., 100 percentiles in ns
+ */
+#define USBIO_PROFILE_QUANTILES	11
+
+struct usbio_profile {
+	uint64_t	idle;
+	uint64_t	first[USBIO_PROFILE_QUANTILES];
+	uint64_t	rtt[USBIO_PROFILE_QUANTILES];
+	uint64_t	burst[USBIO_PROFILE_QUANTILES];
+};
+
+/* opened devices, in -f order */
+#define USBIO_MAXDEVS		1024
+
+struct usbio_dev {
+	int		fd;
+	char		path[256];
+	unsigned char	out[2];		/* shadow of port 1 and port 2 */
+	int		known;		/* shadow has been read */
+	unsigned char	seqno;		/* for users of a device per thread */
+	/* identity, from USB_GET_DEVICEINFO */
+	uint16_t	vendor;
+	uint16_t	product;
+	uint8_t		bus;
+	uint8_t		addr;
+	uint8_t		hubport;	/* port on the parent hub */
+	char		serial[128];
+};
+
+/* devices of one bus, see topo.c */
+#define USBIO_MAXBUSES		64
+
+struct usbio_bus {
+	int		bus;
+	int		ndevs;
+	int		*dev;		/* indices in devs[], by hub port */
+};
+
+/* command line options shared by modes */
+struct usbio_opts {
+	int		port;		/* -p: port to write */
+	int		rate;		/* -r: scan/sample rate in Hz */
+	int		duration;	/* -t: run time in seconds, 0 = forever */
+	int		count;		/* -n: mode specific count */
+	unsigned char	mask;		/* -c: mode specific pin mask */
+	const char	*seqfile;	/* -s: sequence file */
+	int		tolerance;	/* -O: optimizer tolerance in ms */
+	const char	*profile;	/* -P: device latency profile */
+	const char	*ckpt;		/* -K: sequence checkpoint file */
+	const char	*ctlsock;	/* -S: control socket of serve mode */
+	const char	*wdshm;		/* -W: watchdog heartbeat counters */
+	const char	*capture;	/* -w: input capture file */
+	const char	*wear;		/* -R: output transition counters */
+};
+
+/* a compiled sequence, see seq.c */
+struct seq_step {
+	uint64_t	t;		/* ns from the start */
+	int		dev;		/* index in devs[] */
+	int		ports;		/* USBIO_PORT1 | USBIO_PORT2 */
+	unsigned char	val[2];
+	unsigned char	mask[2];	/* bits written by this step */
+	int		line;		/* source line or value number */
+};
+
+struct seq {
+	struct seq_step	*step;
+	int		n, size;
+};
+
+/*
+ * position of a playing sequence, kept in a mmap'd file, see ckpt.c
+ *   out[] is updated before next, so a step may be played twice on
+ *   resume but never skipped; a step writes absolute values, so playing
+ *   it twice is harmless
+ */
+#define USBIO_CKPT_MAGIC	0x55494f4b	/* "UIOK" */
+#define USBIO_CKPT_SYNC		1024		/* steps between msync()s */
+
+struct usbio_ckpt {
+	uint32_t	magic;
+	uint32_t	nsteps;
+	uint64_t	hash;		/* of the compiled sequence */
+	uint32_t	ndevs;
+	volatile uint32_t next;		/* first step not acknowledged */
+	volatile uint32_t done;		/* sequence completed */
+	uint32_t	pad;
+	volatile uint64_t t;		/* sequence time of step next - 1 */
+	volatile unsigned char out[USBIO_MAXDEVS][2];
+};
+
+/*
+ * heartbeat counters of the watchdog mode (-W file), see watchdog.c
+ *   a client renews lease id by incrementing beat[id] in the mapped file
+ */
+#define USBIO_WD_MAGIC		0x55494f57	/* "UIOW" */
+#define USBIO_WD_MAXLEASES	8192
+
+struct usbio_wdshm {
+	uint32_t	magic;
+	uint32_t	nleases;
+	volatile uint32_t beat[USBIO_WD_MAXLEASES];
+};
+
+/*
+ * output transition counters (-R file), see wear.c
+ *   an entry per device, found by serial number, or path without one
+ */
+#define USBIO_WEAR_MAGIC	0x55494f52	/* "UIOR" */
+#define USBIO_WEAR_PINS		12		/* port 1, then port 2 */
+
+struct usbio_wear_ent {
+	char		key[256];	/* whole, as usbio_dev's path */
+	uint16_t	vendor;
+	uint16_t	product;
+	unsigned char	out[2];		/* last value written */
+	uint8_t		known;		/* out is valid */
+	uint8_t		pad;
+	uint64_t	writes;
+	uint64_t	toggles[USBIO_WEAR_PINS];
+};
+
+struct usbio_wear {
+	uint32_t	magic;
+	uint32_t	nents;
+	struct usbio_wear_ent ent[USBIO_MAXDEVS];
+};
+
+/* write verification against the reply, see usbio_write2() */
+#define USBIO_VERIFY_NONE	0
+#define USBIO_VERIFY_ALL	1	/* every write */
+#define USBIO_VERIFY_NTH	2	/* every Nth write */
+#define USBIO_VERIFY_CHANGE	3	/* writes changing the port value */
+#define USBIO_VERIFY_RETRIES	2
+
+struct usbio_verify {
+	int		strategy;
+	int		nth;
+	int		retries;
+	unsigned char	last[3];	/* last value written, per port */
+	int		valid[3];
+	uint64_t	writes;
+	uint64_t	checked;
+	uint64_t	mismatches;
+	uint64_t	retried;
+	uint64_t	failed;
+	uint64_t	ns;		/* time spent waiting for replies */
+};
+
+/* global variables */
+extern unsigned char seqno;
+extern const char *usbio_devdir;
+extern int usbio_debug;
+extern struct usbio_verify verify;
+extern struct usbio_opts opts;
+extern struct usbio_dev devs[USBIO_MAXDEVS];
+extern int ndevs;
+extern volatile sig_atomic_t interrupted;
+
+/* usbio.c */
+int	usbio_check(int, struct usbio_dev *);
+int	usbio_lookup(struct usbio_dev *);
+int	usbio_lookup_all(void);
+int	usbio_open(const char *, struct usbio_dev *);
+int	usbio_sim_info(int, struct usb_device_info *);
+int	usbio_read2(int, unsigned char, unsigned char *);
+int	usbio_send2(int, unsigned char *);
+void	usbio_stop(void);
+int	usbio_trace_open(const char *);
+int	usbio_write2(int, int, unsigned char *);
+int	usbio_verify_parse(const char *);
+void	usbio_verify_report(void);
+void	usbio_frame2(unsigned char *, int, unsigned char, unsigned char);
+int	usbio_xfer2(int, unsigned char *);
+int	usbio_try2(int, unsigned char *);
+int	usbio_value(const char *);
+void	usbio_sleep_until(uint64_t);
+
+/* bench.c */
+int	bench_main(int, int, char **);
+
+/* capture.c */
+struct usbio_capw *cap_create(const char *, int, uint64_t, uint64_t);
+void	cap_write(struct usbio_capw *, const struct usbio_cap_rec *);
+int	cap_close(struct usbio_capw *);
+int	cap_map(const char *, struct usbio_capr *);
+void	cap_unmap(struct usbio_capr *);
+const struct usbio_cap_blk *cap_block(const struct usbio_capr *, uint32_t);
+const struct usbio_cap_rec *cap_recs(const struct usbio_capr *, uint32_t);
+uint32_t cap_nrecs(const struct usbio_capr *, uint32_t);
+uint32_t cap_find(const struct usbio_capr *, uint64_t);
+
+/* clock.c */
+uint64_t usbio_nsec(void);
+int	clock_main(int, int, char **);
+
+/* ckpt.c */
+struct usbio_ckpt *ckpt_open(const char *, struct seq *, int);
+void	ckpt_step(struct usbio_ckpt *, struct seq *, int);
+void	ckpt_close(struct usbio_ckpt *);
+int	resume_main(int, int, char **);
+
+/* check.c */
+int	check_main(int, int, char **);
+
+/* count.c */
+int	count_main(int, int, char **);
+int	freq_main(int, int, char **);
+
+/* profile.c */
+int	profile_load(const char *, struct usbio_profile *);
+void	profile_print(FILE *, struct usbio_profile *);
+uint64_t profile_sample(const uint64_t *, uint32_t);
+
+/* handle.c */
+int	handle_parse(const char *);
+int	handle_lazy(void);
+void	handle_init(void);
+int	usbio_handle(int);
+uint64_t handle_idle(uint64_t);
+void	handle_report(void);
+
+/* ident.c */
+int	usbio_select(const char *, struct usbio_dev *);
+
+/* input.c */
+int	input_match(const unsigned char *, unsigned char);
+void	input_record(const struct usbio_cap_rec *);
+int	monitor_main(int, int, char **);
+
+/* plan.c */
+int	plan_main(int, int, char **);
+
+/* pwm.c */
+int	pwm_main(int, int, char **);
+
+/* safe.c */
+int	safe_parse(const char *);
+void	safe_arm(void);
+void	safe_signal(void);
+int	safe_apply(const char *, uint64_t);
+void	safe_done(int);
+
+/* scan.c */
+int	scan_main(int, int, char **);
+
+/* seq.c */
+void	seq_compile_args(struct seq *, int, int, char **);
+int	seq_compile_file(struct seq *, const char *);
+int	seq_devices(struct seq *, const char *);
+void	seq_sort(struct seq *);
+uint64_t seq_optimize(struct seq *, uint64_t);
+int	seq_play(struct seq *, struct usbio_ckpt *);
+void	seq_free(struct seq *);
+int	seq_main(int, int, char **);
+
+/* serve.c */
+int	serve_socket(const char *);
+int	serve_main(int, int, char **);
+int	ctl_main(int, int, char **);
+
+/* topo.c */
+int	topo_build(struct usbio_bus **);
+int	topo_bus(int);
+uint64_t topo_next(int);
+void	topo_take(int, uint64_t);
+int	fanout_main(int, int, char **);
+
+/* trigger.c */
+int	trigger_parse(const char *);
+int	trigger_on(void);
+void	trigger_init(void);
+void	trigger_sample(const struct usbio_cap_rec *);
+void	trigger_report(void);
+
+/* txn.c */
+int	txn_constraint(const char *);
+int	txn_main(int, int, char **);
+
+/* watchdog.c */
+int	watchdog_main(int, int, char **);
+
+/* wear.c */
+void	wear_open(const char *);
+void	wear_attach(int);
+void	wear_write(int, const unsigned char *);
+int	wear_main(int, int, char **);
+
+#endif /* _USBIO_H_ */
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usbiocap: query input captures of usbioctl -m monitor -w
+ *
+ * "usbiocap -p 1.0-1.3 -s 14:02 -e 14:05 file" prints the state of the
+ * pins at 14:02 and their changes until 14:05.  The file is mapped, the
+ * block of the start time is found by a binary search over the block
+ * summaries, the state at the start comes from the summary of that block,
+ * and blocks where none of the pins asked for changed are skipped, see
+ * capture.c.
+ *
+ * Times are "HH:MM[:SS]" (the first such time from the start of the
+ * capture), "YYYY-MM-DD HH:MM[:SS]", or "+seconds" from the start.
+ *
+ * -M merges the captures of several runs, say one per host or board,
+ * into one timeline.  Each capture has its own monotonic clock; its times
+ * are moved onto the clock of the capture started first through their
+ * CLOCK_REALTIME anchors, plus an offset per capture (-o) for what is
+ * left between the wall clocks of the hosts.  The captures are read in
+ * order through their mappings, their next records kept in a heap by
+ * time, and the pages read are given back as the merge goes, so the
+ * memory used does not grow with the captures.  Devices are numbered in
+ * the order of the captures: the devices of the second one follow those
+ * of the first, and so on.
+ *
+ * -g writes a synthetic capture, for testing and benchmarks: records of
+ * random devices, each toggling one of pins 1.4-2.3, except in short
+ * events every GEN_EVENT records where pins 1.0-1.3 toggle.  -B runs
+ * random queries over a capture and reports their latency.
+ */
+
+#include <sys/mman.h>	/* madvise() */
+#include <sys/resource.h>	/* getrusage() */
+#include <sys/stat.h>	/* stat() */
+
+#include <err.h>	/* err() */
+#include <stdio.h>
+#include <stdlib.h>	/* arc4random_uniform(), qsort(), strtol() */
+#include <string.h>	/* memcpy(), memset() */
+#include <time.h>	/* clock_gettime(), localtime(), mktime() */
+#include <unistd.h>	/* getopt(), getpagesize() */
+
+#include "usbio.h"
+
+#define GEN_DEFAULT_RECS	10000000
+#define GEN_DEFAULT_DEVS	16
+#define GEN_DEFAULT_INTERVAL	1000		/* us between records */
+#define GEN_EVENT		1000000		/* records between events */
+#define GEN_EVENT_LEN		200		/* records of an event */
+#define BENCH_DEFAULT_WINDOW	180		/* seconds */
+
+struct query {
+	uint64_t	start, end;	/* monotonic, ns */
+	uint16_t	mask;		/* pins */
+	int		dev;		/* -1: all */
+	int		print;
+	/* results */
+	uint64_t	matches;
+	uint32_t	scanned, skipped;
+};
+
+/* a capture being merged */
+struct merge_in {
+	struct usbio_capr cr;
+	const char	*path;
+	int64_t		shift;		/* ns, onto the merged clock */
+	int		base;		/* of its devices in the merge */
+	uint32_t	k, i, n;	/* block, record in it, records */
+	const struct usbio_cap_rec *r;
+	size_t		released;	/* pages given back, bytes */
+};
+
+/* the heap of the next records, by time */
+struct merge_ent {
+	uint64_t	t;
+	int		in;
+};
+
+/* prototypes */
+void	usage(void);
+
+static uint64_t
+cap_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * parse "1.0-1.3,2.1" into a pin mask
+ */
+static int
+parse_pins(const char *spec, uint16_t *mask) {
+	char *ep;
+	long port, bit, from, to;
+
+	*mask = 0;
+	for (;;) {
+		port = strtol(spec, &ep, 10);
+		if (*ep != '.' || port < 1 || port > 2)
+			return -1;
+		bit = strtol(ep + 1, &ep, 10);
+		if (bit < 0 || bit > (port == 1 ? 7 : 3))
+			return -1;
+		from = to = (port - 1) * 8 + bit;
+		if (*ep == '-') {
+			port = strtol(ep + 1, &ep, 10);
+			if (*ep != '.' || port < 1 || port > 2)
+				return -1;
+			bit = strtol(ep + 1, &ep, 10);
+			if (bit < 0 || bit > (port == 1 ? 7 : 3))
+				return -1;
+			to = (port - 1) * 8 + bit;
+		}
+		for (; from <= to; from++)
+			*mask |= 1 << from;
+		if (*ep != ',')
+			break;
+		spec = ep + 1;
+	}
+	return *ep == '\0' && *mask != 0 ? 0 : -1;
+}
+
+/*
+ * parse a time into the monotonic clock of the capture
+ *   a time before the start of the capture is its start
+ */
+static int
+parse_time(const char *s, const struct usbio_cap_hdr *h, uint64_t *t) {
+	struct tm tm;
+	time_t start = h->t0_real / 1000000000, real;
+	int64_t d;
+	double sec;
+	char *ep;
+	int n, year = -1, mon, day, hour, min, isec = 0;
+
+	if (*s == '+') {
+		sec = strtod(s + 1, &ep);
+		if (*ep != '\0' || sec < 0)
+			return -1;
+		*t = h->t0 + (uint64_t)(sec * 1e9);
+		return 0;
+	}
+	localtime_r(&start, &tm);
+	if (sscanf(s, "%d-%d-%d%*[ T]%d:%d%n", &year, &mon, &day, &hour,
+	    &min, &n) == 5) {
+		tm.tm_year = year - 1900;
+		tm.tm_mon = mon - 1;
+		tm.tm_mday = day;
+	} else if (sscanf(s, "%d:%d%n", &hour, &min, &n) != 2)
+		return -1;
+	s += n;
+	if (*s == ':' && sscanf(s, ":%d%n", &isec, &n) == 1)
+		s += n;
+	if (*s != '\0')
+		return -1;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = isec;
+	tm.tm_isdst = -1;
+	if ((real = mktime(&tm)) == -1)
+		return -1;
+	if (year == -1 && real < start)
+		real += 24 * 60 * 60;	/* the next day */
+	d = real * 1000000000LL - (int64_t)h->t0_real;
+	*t = d < 0 ? h->t0 : h->t0 + d;
+	return 0;
+}
+
+static void
+print_rec(const struct usbio_cap_hdr *h, uint64_t t, int dev, uint16_t pins,
+	const char *what, uint16_t changed) {
+	uint64_t real = h->t0_real + (t - h->t0);
+	time_t sec = real / 1000000000;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&sec, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06llu dev %d: %02x %x %s", buf,
+		(unsigned long long)real / 1000 % 1000000, dev, pins & 0xff,
+		(pins >> 8) & USBIO_PORT2_MASK, what);
+	if (changed)
+		printf(" %03x", changed);
+	printf("\n");
+}
+
+/*
+ * run a query
+ */
+static void
+query(const struct usbio_capr *cr, struct query *q) {
+	const struct usbio_cap_hdr *h = cr->hdr;
+	const struct usbio_cap_blk *b;
+	const struct usbio_cap_rec *r;
+	static uint16_t state[USBIO_MAXDEVS];
+	uint32_t k, k0, i, n;
+	int d;
+
+	q->matches = 0;
+	q->scanned = q->skipped = 0;
+	if (cr->nblocks == 0)
+		return;
+
+	/* the state at the start */
+	k0 = cap_find(cr, q->start);
+	k = k0 < cr->nblocks ? k0 : cr->nblocks - 1;
+	b = cap_block(cr, k);
+	memcpy(state, b->state, h->ndevs * sizeof(*state));
+	r = cap_recs(cr, k);
+	n = cap_nrecs(cr, k);
+	for (i = 0; i < n && r[i].t < q->start; i++)
+		if (r[i].dev < h->ndevs)
+			state[r[i].dev] = r[i].pins | USBIO_CAP_KNOWN;
+	if (q->print)
+		for (d = 0; d < h->ndevs; d++)
+			if ((q->dev == -1 || q->dev == d) &&
+			    (state[d] & USBIO_CAP_KNOWN))
+				print_rec(h, q->start, d, state[d], "state",
+					0);
+
+	/* changes in the range */
+	for (k = k0; k < cr->nblocks; k++) {
+		b = cap_block(cr, k);
+		if (b->t_first > q->end)
+			break;
+		if ((b->changed & q->mask) == 0) {
+			q->skipped++;
+			continue;
+		}
+		q->scanned++;
+		r = cap_recs(cr, k);
+		n = cap_nrecs(cr, k);
+		for (i = 0; i < n && r[i].t <= q->end; i++) {
+			if (r[i].t < q->start ||
+			    (r[i].changed & q->mask) == 0 ||
+			    (q->dev != -1 && r[i].dev != q->dev))
+				continue;
+			q->matches++;
+			if (q->print)
+				print_rec(h, r[i].t, r[i].dev, r[i].pins,
+					"changed", r[i].changed & q->mask);
+		}
+	}
+}
+
+/*
+ * move to the next record of a capture
+ *   return 0 at its end
+ */
+static int
+merge_next(struct merge_in *m, size_t pgmask) {
+	const struct usbio_capr *cr = &m->cr;
+	size_t end;
+
+	if (++m->i < m->n)
+		return 1;
+	for (;;) {
+		/* give back the pages of the blocks done with */
+		end = (sizeof(struct usbio_cap_hdr) + (size_t)(m->k + 1) *
+			USBIO_CAP_BLOCK) & ~pgmask;
+		if (end > cr->size)
+			end = cr->size & ~pgmask;
+		if (end > m->released) {
+			madvise((void *)(cr->base + m->released),
+				end - m->released, MADV_DONTNEED);
+			m->released = end;
+		}
+		if (++m->k >= cr->nblocks)
+			return 0;
+		m->r = cap_recs(cr, m->k);
+		m->n = cap_nrecs(cr, m->k);
+		m->i = 0;
+		if (m->n > 0)
+			return 1;
+	}
+}
+
+/*
+ * move to the first record of a capture
+ *   return 0 if it has none
+ */
+static int
+merge_first(struct merge_in *m, size_t pgmask) {
+	m->k = 0;
+	m->i = 0;
+	m->n = 0;
+	if (m->cr.nblocks == 0)
+		return 0;
+	m->r = cap_recs(&m->cr, 0);
+	m->n = cap_nrecs(&m->cr, 0);
+	return m->n > 0 || merge_next(m, pgmask);
+}
+
+static uint64_t
+merge_time(const struct merge_in *m) {
+	int64_t t = (int64_t)m->r[m->i].t + m->shift;
+
+	return t > 0 ? t : 0;
+}
+
+/* ties go to the earlier capture */
+static int
+merge_less(const struct merge_ent *a, const struct merge_ent *b) {
+	return a->t < b->t || (a->t == b->t && a->in < b->in);
+}
+
+/*
+ * restore the heap from i down
+ */
+static void
+merge_sift(struct merge_ent *heap, int n, int i) {
+	struct merge_ent e = heap[i];
+	int c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && merge_less(&heap[c + 1], &heap[c]))
+			c++;
+		if (merge_less(&e, &heap[c]))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = e;
+}
+
+/*
+ * merge captures into out
+ *   offsets: "us,us,..." added to the times of each capture, or NULL
+ */
+static int
+merge(const char *out, int nin, char *paths[], const char *offsets) {
+	struct merge_in *in, *m, *ref;
+	struct merge_ent *heap;
+	struct usbio_capw *cw;
+	struct usbio_cap_rec rec;
+	struct rusage ru;
+	struct stat so, si;
+	const char *s = offsets;
+	char *ep;
+	uint64_t t, nrecs = 0, first = 0, last = 0;
+	size_t pgmask = getpagesize() - 1;
+	int i, n, ndevs = 0;
+
+	in = calloc(nin, sizeof(*in));
+	heap = calloc(nin, sizeof(*heap));
+	if (in == NULL || heap == NULL)
+		err(1, "calloc");
+	for (ref = NULL, i = 0; i < nin; i++) {
+		m = &in[i];
+		m->path = paths[i];
+		/* writing it would cut a capture being read */
+		if (stat(out, &so) == 0 && stat(m->path, &si) == 0 &&
+		    so.st_dev == si.st_dev && so.st_ino == si.st_ino)
+			errx(1, "%s: is also an input", out);
+		if (cap_map(m->path, &m->cr) == -1)
+			exit(1);
+		madvise((void *)m->cr.base, m->cr.size, MADV_SEQUENTIAL);
+		m->base = ndevs;
+		ndevs += m->cr.hdr->ndevs;
+		if (ndevs > USBIO_MAXDEVS)
+			errx(1, "more than %d devices", USBIO_MAXDEVS);
+		if (s != NULL && *s != '\0') {
+			m->shift = strtoll(s, &ep, 10) * 1000;
+			if (*ep != ',' && *ep != '\0')
+				errx(1, "bad offset: %s", s);
+			s = *ep == ',' ? ep + 1 : ep;
+		}
+		if (ref == NULL || m->cr.hdr->t0_real < ref->cr.hdr->t0_real)
+			ref = m;
+	}
+	if (s != NULL && *s != '\0')
+		errx(1, "more offsets than captures");
+
+	/* the clocks, and the first record of each capture */
+	for (n = 0, i = 0; i < nin; i++) {
+		m = &in[i];
+		printf("%s: devices %d-%d, start %+.6f s\n", m->path, m->base,
+			m->base + m->cr.hdr->ndevs - 1, (m->shift +
+			(int64_t)(m->cr.hdr->t0_real - ref->cr.hdr->t0_real)) /
+			1e9);
+		m->shift += (int64_t)(m->cr.hdr->t0_real -
+			ref->cr.hdr->t0_real) -
+			(int64_t)(m->cr.hdr->t0 - ref->cr.hdr->t0);
+		if (!merge_first(m, pgmask))
+			continue;
+		heap[n].t = merge_time(m);
+		heap[n].in = i;
+		n++;
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		merge_sift(heap, n, i);
+
+	cw = cap_create(out, ndevs, ref->cr.hdr->t0, ref->cr.hdr->t0_real);
+	t = cap_nsec();
+	while (n > 0) {
+		m = &in[heap[0].in];
+		rec = m->r[m->i];
+		rec.t = heap[0].t;
+		rec.dev += m->base;
+		cap_write(cw, &rec);
+		if (nrecs++ == 0)
+			first = rec.t;
+		last = rec.t;
+		if (merge_next(m, pgmask))
+			heap[0].t = merge_time(m);
+		else
+			heap[0] = heap[--n];
+		merge_sift(heap, n, 0);
+	}
+	if (cap_close(cw) == -1)
+		err(1, "%s", out);
+	t = cap_nsec() - t;
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%llu records of %d devices, %.1f s, merged in %.3f s"
+		" (%.1f M records/s), max rss %ld KB\n",
+		(unsigned long long)nrecs, ndevs, (last - first) / 1e9,
+		t / 1e9, nrecs / (t / 1e3), ru.ru_maxrss);
+	for (i = 0; i < nin; i++)
+		cap_unmap(&in[i].cr);
+	free(in);
+	free(heap);
+	return 0;
+}
+
+/*
+ * write a synthetic capture, started at t0_real (0: now) on the monotonic
+ * clock of a host up for a random time
+ */
+static int
+generate(const char *path, int ndevs, uint64_t nrecs, uint64_t interval,
+	uint64_t t0_real) {
+	struct usbio_capw *cw;
+	struct usbio_cap_rec rec;
+	uint16_t *pins, bit;
+	uint64_t t0, t, i;
+	int d;
+
+	if ((pins = calloc(ndevs, sizeof(*pins))) == NULL)
+		err(1, "calloc");
+	t0 = t = (1 + arc4random_uniform(1000000)) * 1000000000ULL;
+	cw = cap_create(path, ndevs, t0, t0_real);
+	memset(&rec, 0, sizeof(rec));
+	for (d = 0; d < ndevs; d++) {
+		pins[d] = arc4random_uniform(0x1000);
+		rec.t = t;
+		rec.dev = d;
+		rec.pins = pins[d];
+		rec.changed = 0;
+		cap_write(cw, &rec);
+	}
+	for (i = 0; i < nrecs; i++) {
+		t += (1 + arc4random_uniform(2 * interval)) * 1000ULL;
+		d = arc4random_uniform(ndevs);
+		if (i % GEN_EVENT < GEN_EVENT_LEN)
+			bit = 1 << arc4random_uniform(4);
+		else
+			bit = 1 << (4 + arc4random_uniform(8));
+		pins[d] ^= bit;
+		rec.t = t;
+		rec.dev = d;
+		rec.pins = pins[d];
+		rec.changed = bit;
+		cap_write(cw, &rec);
+	}
+	if (cap_close(cw) == -1)
+		err(1, "%s", path);
+	free(pins);
+	printf("%llu records of %d devices, %.1f s\n",
+		(unsigned long long)nrecs + ndevs, ndevs,
+		(t - t0) / 1e9);
+	return 0;
+}
+
+static int
+u64cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * run random queries of window seconds
+ */
+static int
+bench(const struct usbio_capr *cr, struct query *q, int nq, uint64_t window) {
+	uint64_t first, last, span, *lat, matches = 0, scanned = 0;
+	uint64_t skipped = 0, t;
+	int i;
+
+	if (cr->nblocks == 0)
+		errx(1, "empty capture");
+	first = cap_block(cr, 0)->t_first;
+	last = cap_block(cr, cr->nblocks - 1)->t_last;
+	span = last - first > window ? last - first - window : 1;
+	if ((lat = calloc(nq, sizeof(*lat))) == NULL)
+		err(1, "calloc");
+	q->print = 0;
+	for (i = 0; i < nq; i++) {
+		q->start = first + ((uint64_t)arc4random() << 32 |
+			arc4random()) % span;
+		q->end = q->start + window;
+		t = cap_nsec();
+		query(cr, q);
+		lat[i] = cap_nsec() - t;
+		matches += q->matches;
+		scanned += q->scanned;
+		skipped += q->skipped;
+	}
+	qsort(lat, nq, sizeof(*lat), u64cmp);
+	printf("%u blocks, %d queries of %llu s: latency us p50 %.1f"
+		" p99 %.1f max %.1f\n", cr->nblocks, nq,
+		(unsigned long long)window / 1000000000, lat[nq / 2] / 1e3,
+		lat[nq * 99 / 100] / 1e3, lat[nq - 1] / 1e3);
+	printf("per query: %.1f blocks scanned, %.1f skipped, %.1f changes\n",
+		(double)scanned / nq, (double)skipped / nq,
+		(double)matches / nq);
+	free(lat);
+	return 0;
+}
+
+/*
+ * main
+ */
+int
+main(int argc, char *argv[]) {
+	struct usbio_capr cr;
+	struct query q;
+	const char *start = NULL, *end = NULL, *out = NULL, *offsets = NULL;
+	uint64_t nrecs = GEN_DEFAULT_RECS, interval = GEN_DEFAULT_INTERVAL;
+	uint64_t window = BENCH_DEFAULT_WINDOW, t0_real = 0, t;
+	int ch, gen = 0, nq = 0, ndevs = GEN_DEFAULT_DEVS;
+
+	memset(&q, 0, sizeof(q));
+	q.mask = 0x0fff;
+	q.dev = -1;
+	q.print = 1;
+	while ((ch = getopt(argc, argv, "B:D:d:e:gi:M:n:o:p:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'B':
+			nq = atoi(optarg);
+			if (nq < 1)
+				usage();	/* not return */
+			break;
+		case 'D':
+			ndevs = atoi(optarg);
+			if (ndevs < 1 || ndevs > USBIO_MAXDEVS)
+				usage();	/* not return */
+			break;
+		case 'd':
+			q.dev = atoi(optarg);
+			break;
+		case 'e':
+			end = optarg;
+			break;
+		case 'g':
+			gen = 1;
+			break;
+		case 'i':
+			interval = strtoull(optarg, NULL, 10);
+			if (interval < 1)
+				usage();	/* not return */
+			break;
+		case 'M':
+			out = optarg;
+			break;
+		case 'n':
+			nrecs = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			offsets = optarg;
+			break;
+		case 'p':
+			if (parse_pins(optarg, &q.mask) == -1)
+				usage();	/* not return */
+			break;
+		case 's':
+			start = optarg;
+			break;
+		case 't':
+			t0_real = strtoull(optarg, NULL, 10) * 1000000000ULL;
+			break;
+		case 'w':
+			window = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (out != NULL) {
+		if (argc < 1)
+			usage();	/* not return */
+		exit(merge(out, argc, argv, offsets));
+	}
+	if (argc != 1)
+		usage();	/* not return */
+
+	if (gen)
+		exit(generate(argv[0], ndevs, nrecs, interval, t0_real));
+
+	if (cap_map(argv[0], &cr) == -1)
+		exit(1);
+	if (nq > 0)
+		exit(bench(&cr, &q, nq, window * 1000000000ULL));
+
+	q.start = 0;
+	q.end = UINT64_MAX;
+	if ((start != NULL && parse_time(start, cr.hdr, &q.start) == -1) ||
+	    (end != NULL && parse_time(end, cr.hdr, &q.end) == -1))
+		errx(1, "bad time, HH:MM[:SS], YYYY-MM-DD HH:MM[:SS]"
+			" or +seconds");
+	if (start == NULL && cr.nblocks > 0)
+		q.start = cap_block(&cr, 0)->t_first;
+	t = cap_nsec();
+	query(&cr, &q);
+	fprintf(stderr, "%llu changes, %u of %u blocks scanned, %u skipped,"
+		" %.1f us\n", (unsigned long long)q.matches, q.scanned,
+		cr.nblocks, q.skipped, (cap_nsec() - t) / 1e3);
+	cap_unmap(&cr);
+	exit(0);
+}
+
+__dead void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-d dev] [-e end] [-p pins] [-s start]"
+		" capfile\n", getprogname());
+	fprintf(stderr, "       %s -B queries [-d dev] [-p pins] [-w window_s]"
+		" capfile\n", getprogname());
+	fprintf(stderr, "       %s -g [-D devices] [-i interval_us]"
+		" [-n records] [-t start] capfile\n", getprogname());
+	fprintf(stderr, "       %s -M outfile [-o offset_us,...]"
+		" capfile ...\n", getprogname());
+	fprintf(stderr, "	pins: 1.0-1.3,2.1 ...\n");
+	exit(2);
+}
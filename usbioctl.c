@@ -19,164 +19,61 @@
  */
 
 #include <err.h>	/* err() */
-#include <fcntl.h>	/* open() */
+#include <signal.h>	/* signal() */
 #include <stdio.h>
 #include <stdlib.h>	/* atoi(), strtol() */
-#include <string.h>	/* memset() */
-#include <unistd.h>	/* close(), getopt(), read(), write() */
+#include <string.h>	/* strcmp() */
+#include <unistd.h>	/* close(), getopt() */
 
 #include <dev/usb/usb.h>
 
-#define	DEFAULT_PORT	2
+#include "usbio.h"
 
-/*
- * USB-IO(2.0) commands (not complete list)
- */
-#define USBIO2_RW		0x20
-
-#define USBIO_PORT2_MASK	0x0f
+/* global variables */
+struct usbio_opts opts;
+struct usbio_dev devs[USBIO_MAXDEVS];
+int ndevs = 0;
+static const char *devsel[USBIO_MAXDEVS];	/* -i selectors */
+volatile sig_atomic_t interrupted = 0;
 
-#define DEBUG
-#ifdef DEBUG
-#define DPRINTF(...)	do { fprintf(stderr, __VA_ARGS__); } while (0)
-#else
-#define DPRINTF(...)
-#endif
+/* operation modes, other than the default "write" */
+#define MODE_NODEV	0x01	/* does not use a device */
+#define MODE_ALLDEVS	0x02	/* opens every device found, as -a */
+#define MODE_LAZY	0x04	/* opens -f devices on first use with -I */
 
-/* USB-IO vendor and product ID */
 struct {
-	uint16_t	vendor;
-	uint16_t	product;
-	int		protocol_version;	/* 1 or 2 */
-} usbio_models [] = {
-#if 0	/* not supported yet */
-	0x0bfe, 0x1003, 1,	/* Morphy Planning USB-IO 1.0 */
-	0x1352, 0x0100, 1,	/* Km2Net USB-IO 1.0 */
-#endif
-	0x1352, 0x0120, 2,	/* Km2Net USB-IO 2.0 */
-	0x1352, 0x0121, 2,	/* Km2Net USB-IO 2.0(AKI) */
+	const char	*name;
+	int		(*func)(int, int, char **);
+	int		flags;
+} usbio_modes [] = {
+	{ "bench",	bench_main,	0 },
+	{ "check",	check_main,	MODE_NODEV },
+	{ "clock",	clock_main,	MODE_NODEV },
+	{ "count",	count_main,	0 },
+	{ "ctl",	ctl_main,	MODE_NODEV },
+	{ "fanout",	fanout_main,	0 },
+	{ "freq",	freq_main,	0 },
+	{ "monitor",	monitor_main,	MODE_ALLDEVS },
+	{ "plan",	plan_main,	MODE_ALLDEVS },
+	{ "pwm",	pwm_main,	0 },
+	{ "resume",	resume_main,	0 },
+	{ "scan",	scan_main,	0 },
+	{ "serve",	serve_main,	MODE_LAZY },
+	{ "txn",	txn_main,	0 },
+	{ "watchdog",	watchdog_main,	0 },
+	{ "wear",	wear_main,	MODE_NODEV },
 };
 
-/* global variables */
-unsigned char seqno = 0;
-
 /* prototypes */
-int	usbio_check(int);
-int	usbio_lookup(void);
-int	usbio_open(const char *);
-int	usbio_write2(int, int, unsigned char *);
 void	usage(void);
 
 /*
- * check vendor/product IDs on an opened file descriptor
- *   return its protocol version (currently 2 only) if found
- *   return -1 if not found
+ * signal handler: ask the running mode to finish
  */
-int
-usbio_check(int fd) {
-	int i, ret;
-	int n = sizeof(usbio_models) / sizeof(usbio_models[0]);
-	struct usb_device_info udi;
-
-	ret = ioctl(fd, USB_GET_DEVICEINFO, &udi);
-	if (ret == -1)
-		err(1, "ioctl");
-
-	DPRINTF("Vendor:0x%04x, Product:0x%04x, Release:0x%04x\n",
-		udi.udi_vendorNo, udi.udi_productNo, udi.udi_releaseNo);
-
-	for (i = 0; i < n; i++)
-		if ((udi.udi_vendorNo == usbio_models[i].vendor) &&
-			(udi.udi_productNo == usbio_models[i].product))
-				return usbio_models[i].protocol_version;
-
-	return -1;	/* not match */
-}
-
-/* 
- * open specified device name, and check 
- */
-int
-usbio_open(const char *devname) {
-	int fd;
-
-	fd = open(devname, O_RDWR);
-	if (fd != -1) {
-		if (usbio_check(fd) != -1)
-			return fd;
-		close(fd);
-	}
-	return -1;
-}
-
-/*
- * look up an USB-IO device and open it
- *   return file descriptor if found
- */
-int
-usbio_lookup(void) {
-	int fd, i;
-	char devname[256];
-
-	for (int i = 0; i < 10; i++) {
-		snprintf(devname, sizeof(devname), "/dev/uhid%d", i);
-		DPRINTF("%s, ", devname);
-		fd = usbio_open(devname);
-		if (fd != -1)
-			return fd;
-	}
-
-	/* exit if we can not find */
-	fprintf(stderr, "can not find/open USB-IO device\n");
-	exit(1);
-}
-
-/*
- * write: protocol version 2
- */
-int
-usbio_write2(int fd, int port, unsigned char *data) {
-	int ret, count;
-	unsigned char buf[64];
-
-	memset(buf, 0x00, sizeof(buf));
-	buf[0] = USBIO2_RW;
-	buf[1] = (unsigned char)port;
-	buf[2] = *data;
-	buf[63] = seqno;
-
-	ret = write(fd, buf, 64);
-	if (ret == -1)
-		err(1, "write");
-	else if (ret != 0) {
-		DPRINTF("write: %02x:%02x %02x %02x %02x"
-			" %02x %02x %02x %02x:%02x\n",
-			buf[0], buf[1], buf[2], buf[3], buf[4],
-			buf[5], buf[6], buf[7], buf[8], buf[63]);
-	}
-
-#if 0
-	count = 0;
-	for(;;) {
-		ret = read(fd, buf, 64);
-		count++;
-		if (ret == -1)
-			err(1, "read");
-		if (ret == 0)
-			break;
-		if (buf[63] == seqno) {
-			DPRINTF("read : %02x:%02x %02x %02x %02x"
-				" %02x %02x %02x %02x:%02x\n",
-				buf[0], buf[1], buf[2], buf[3], buf[4],
-				buf[5], buf[6], buf[7], buf[8], buf[63]);
-			DPRINTF("read : count = %d\n", count);
-			break;
-		}
-	}
-#endif
-
-	seqno++;
-	return ret;
+void
+sighandler(int sig) {
+	safe_signal();
+	interrupted = 1;
 }
 
 /*
@@ -186,20 +83,76 @@ int
 main(int argc, char *argv[]) {
 	int ch, count = 0;
 	int port = DEFAULT_PORT;
-	int f_flag = 0;
+	int a_flag = 0;
 	int fd, i, ret, val;
+	int (*mode)(int, int, char **) = NULL;
+	int mode_flags = 0;
 	unsigned char data;
-	char devname[256];
 
-	strlcpy(devname, "", sizeof(devname));
+	opts.tolerance = -1;
 
 	/* getopt part */
-	while ((ch = getopt(argc, argv, "f:p:")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "aC:c:D:df:I:i:K:m:n:O:P:p:R:r:S:s:T:t:V:W:w:X:Z:")) != -1) {
 		switch (ch) {
+		case 'a':
+			a_flag = 1;
+			break;
+		case 'C':
+			if (txn_constraint(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'c':
+			opts.mask = (unsigned char)strtol(optarg, NULL, 16);
+			break;
+		case 'D':
+			usbio_devdir = optarg;
+			break;
+		case 'd':
+			usbio_debug = 1;
+			break;
 		case 'f':
-			f_flag = 1;
-			strlcpy(devname, optarg, sizeof(devname));
-			DPRINTF("option f:%s\n", devname);
+			if (ndevs == USBIO_MAXDEVS)
+				usage();	/* not return */
+			strlcpy(devs[ndevs].path, optarg,
+				sizeof(devs[ndevs].path));
+			DPRINTF("option f:%s\n", devs[ndevs].path);
+			ndevs++;
+			break;
+		case 'I':
+			if (handle_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'i':
+			if (ndevs == USBIO_MAXDEVS)
+				usage();	/* not return */
+			devsel[ndevs] = optarg;
+			DPRINTF("option i:%s\n", optarg);
+			ndevs++;
+			break;
+		case 'K':
+			opts.ckpt = optarg;
+			break;
+		case 'm':
+			for (i = 0; i < sizeof(usbio_modes) /
+			    sizeof(usbio_modes[0]); i++)
+				if (strcmp(optarg, usbio_modes[i].name) == 0) {
+					mode = usbio_modes[i].func;
+					mode_flags = usbio_modes[i].flags;
+				}
+			if (mode == NULL && strcmp(optarg, "write") != 0)
+				usage();	/* not return */
+			break;
+		case 'n':
+			opts.count = atoi(optarg);
+			break;
+		case 'O':
+			opts.tolerance = atoi(optarg);
+			if (opts.tolerance < 0)
+				usage();	/* not return */
+			break;
+		case 'P':
+			opts.profile = optarg;
 			break;
 		case 'p':
 			val = atoi(optarg);
@@ -208,7 +161,44 @@ main(int argc, char *argv[]) {
 			port = val;
 			DPRINTF("p:%d\n", port);
 			break;
-		defailt:
+		case 'R':
+			opts.wear = optarg;
+			break;
+		case 'r':
+			opts.rate = atoi(optarg);
+			break;
+		case 'S':
+			opts.ctlsock = optarg;
+			break;
+		case 's':
+			opts.seqfile = optarg;
+			break;
+		case 'T':
+			if (usbio_trace_open(optarg) == -1)
+				err(1, "%s", optarg);
+			break;
+		case 't':
+			opts.duration = atoi(optarg);
+			break;
+		case 'V':
+			if (usbio_verify_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'W':
+			opts.wdshm = optarg;
+			break;
+		case 'w':
+			opts.capture = optarg;
+			break;
+		case 'X':
+			if (trigger_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'Z':
+			if (safe_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		default:
 			usage();
 			break;
 		}
@@ -216,18 +206,55 @@ main(int argc, char *argv[]) {
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1)
+	/* a sequence file, -O or -K needs a compiled sequence */
+	if (mode == NULL && (opts.seqfile != NULL || opts.tolerance >= 0 ||
+	    opts.ckpt != NULL))
+		mode = seq_main;
+
+	/* modes check their own arguments */
+	if (argc < 1 && mode == NULL)
 		usage();	/* not return */
 
-	if (f_flag) {
-		fd = usbio_open(devname);
-		if (fd == -1) {
+	if (mode_flags & MODE_NODEV) {
+		opts.port = port;
+		exit(mode(-1, argc, argv));
+	}
+
+	if ((mode_flags & MODE_ALLDEVS) && ndevs == 0)
+		a_flag = 1;
+	for (i = 0; i < ndevs; i++) {
+		if (devsel[i] != NULL) {
+			if (usbio_select(devsel[i], &devs[i]) == -1) {
+				fprintf(stderr, "can not find USB-IO device"
+					" matching %s\n", devsel[i]);
+				exit(1);
+			}
+			continue;
+		}
+		if ((mode_flags & MODE_LAZY) && handle_lazy()) {
+			devs[i].fd = -1;	/* see handle.c */
+			continue;
+		}
+		if (usbio_open(devs[i].path, &devs[i]) == -1) {
 			fprintf(stderr, "can not open USB-IO device on %s\n",
-				devname);
+				devs[i].path);
 			exit(1);
 		}
-	} else
-		fd = usbio_lookup();
+	}
+	if (a_flag && usbio_lookup_all() == 0) {
+		fprintf(stderr, "can not find/open USB-IO device\n");
+		exit(1);
+	}
+	if (ndevs == 0) {
+		usbio_lookup(&devs[0]);
+		ndevs = 1;
+	}
+	fd = devs[0].fd;
+	if (opts.wear != NULL)
+		wear_open(opts.wear);
+	safe_arm();
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
 
 #if 0
 	ret = ioctl(fd, USB_GET_REPORT_ID, &rid);
@@ -250,29 +277,95 @@ main(int argc, char *argv[]) {
 	}
 #endif
 
-	for (i = 0; i < argc; i++) {
-		val = (int)strtol(argv[i], (char **)NULL, 16);
-		if ((val < 0) || (val > 255)) {
-			fprintf(stderr, "data %d: value = %d, out of range\n",
-				i, val);
+	if (mode != NULL) {
+		opts.port = port;
+		ret = mode(fd, argc, argv);
+		safe_done(ret == 0);
+		exit(ret);
+	}
+
+	for (i = 0; i < argc && !interrupted; i++) {
+		val = usbio_value(argv[i]);
+		if (val == -1) {
+			fprintf(stderr, "data %d: value = %s, out of range\n",
+				i, argv[i]);
 			exit(1);
 		}
 		data = (char)val;
 		if (port == 2)
 			data = data & USBIO_PORT2_MASK;
-		usbio_write2(fd, port, &data);
+		if (usbio_write2(fd, port, &data) == -1)
+			count++;
 
-		sleep(3);	/* wait for 3 second */
+		if (i + 1 < argc)
+			sleep(3);	/* wait for 3 second */
 	}
 
-	close(fd);
-	exit(0);
+	usbio_verify_report();
+	safe_done(count == 0);
+	exit(count ? 1 : 0);
 }
 
 __dead void
 usage(void) {
-	fprintf(stderr, "Usage: %s [-f device] [-p port] value [value ...]\n",
+	fprintf(stderr, "Usage: %s [-d] [-D devdir] [-f device] [-p port]"
+		" [-T trace]\n"
+		"\t\t[-V all|change|N[:retries]] value [value ...]\n",
+		getprogname());
+	fprintf(stderr, "       %s [-D devdir]"
+		" -i serial=S|product=0xP|port=BUS-PORT[,...]\n"
+		"\t\t... [...]\n", getprogname());
+	fprintf(stderr, "       %s [-f device ...] [-K ckptfile]"
+		" [-O tolerance_ms] [-p port]\n"
+		"\t\t[-s seqfile] [value ...]\n", getprogname());
+	fprintf(stderr, "       %s [-f device ...] -m resume -K ckptfile"
+		" [-O tolerance_ms]\n"
+		"\t\t[-p port] [-s seqfile] [value ...]\n", getprogname());
+	fprintf(stderr, "       %s -m check [-O tolerance_ms] [-P profile]"
+		" [-p port] [-s seqfile]\n"
+		"\t\t[value ...]\n", getprogname());
+	fprintf(stderr, "       %s [-f device] -m scan [-c colmask]"
+		" [-n debounce] [-r rate]\n"
+		"\t\t[-t sec] digit [digit ...]\n", getprogname());
+	fprintf(stderr, "       %s [-f device] -m count|freq [-n gate_ms]"
+		" [-r rate] [-t sec]\n", getprogname());
+	fprintf(stderr, "       %s [-f device] -m pwm [-n slot_us] [-r freq]"
+		" [-t sec]\n"
+		"\t\tport.bit:duty [...]\n", getprogname());
+	fprintf(stderr, "       %s [-f device ...] -m txn [-C clear]"
+		" [-C bbm=pin+pin...]\n"
+		"\t\t[dev:]port=value[/mask],... [...]\n", getprogname());
+	fprintf(stderr, "       %s [-a] [-f device ...] -m bench [-n count]\n",
+		getprogname());
+	fprintf(stderr, "       %s [-a] [-f device ...] -m fanout [-r rate]"
+		" [-t sec] [bus | single]\n", getprogname());
+	fprintf(stderr, "       %s [-a] [-f device ...] -m monitor [-n slow_ms]"
+		" [-r rate] [-t sec]\n"
+		"\t\t[-w capfile] [-X [dev:]port.bit=0|1|r|f|e,..."
+		"[,pre=N][,post=N]]\n", getprogname());
+	fprintf(stderr, "       %s [-D devdir] -m plan [-O tolerance_ms]"
+		" [-r rate]\n"
+		"\t\t-s planfile | planfile\n", getprogname());
+	fprintf(stderr, "       %s [-a] [-f device ...] -m serve"
+		" [-I idle_ms[:maxopen]] [-r rate]\n"
+		"\t\t-S ctlsock\n", getprogname());
+	fprintf(stderr, "       %s [-a] [-f device ...] -m watchdog"
+		" [-S ctlsock] [-W beatfile]\n"
+		"\t\t[[dev:]port=value[/mask]@interval_ms ...]\n",
+		getprogname());
+	fprintf(stderr, "       %s -m wear -R wearfile [-n rated_cycles]\n",
+		getprogname());
+	fprintf(stderr, "       %s -m clock [-n calls] [-t sec]\n",
 		getprogname());
-	fprintf(stderr, "	Default port = %d\n", DEFAULT_PORT);
+	fprintf(stderr, "       %s -m ctl -S ctlsock run prio seqfile |"
+		" cancel handle [safe=P1:P2]\n"
+		"\t\t| list | hb ms | lease spec | beat id |"
+		" release id\n", getprogname());
+	fprintf(stderr, "\t-Z [dev=]P1:P2,... is applied on signals, errors"
+		" and heartbeat lapse\n");
+	fprintf(stderr, "\t-T records all reports of any mode into trace\n");
+	fprintf(stderr, "\t-R counts output transitions of any mode into"
+		" wearfile\n");
+	fprintf(stderr, "\tDefault port = %d\n", DEFAULT_PORT);
 	exit(2);
 }
@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * usbiosim: simulate many USB-IO 2.0 devices
+ *
+ * Each device is a SOCK_SEQPACKET unix domain socket named uhidN in the
+ * given directory, so "usbioctl -D dir" finds them just like /dev/uhidN.
+ * Like uhid(4), a device has one opener at a time.  A request is answered
+ * after a latency drawn from the device's model; a device handles one
+ * request at a time, so requests sent in a burst queue up behind each
+ * other.  Input pins read back what was last written to them.
+ *
+ * A latency model is either a fixed base with uniform jitter, or a
+ * profile fitted from a trace of a real board (usbioctl -T) by -F: the
+ * first request after the board was idle, a request to a board with
+ * nothing outstanding and a request queued behind another one each draw
+ * from their own distribution.
+ *
+ * With -B, devices are spread over several buses, "28,4" puts 28 devices
+ * on bus 1 and 4 on bus 2.  A bus carries one transaction at a time, each
+ * taking a slot of SIM_BUS_SLOT (or "@slot_us"), so devices of a busy bus
+ * wait for each other while devices on other buses do not.
+ *
+ * -E edge_us,burst,idle_ms drives pin 1.0 of every device from outside:
+ * bursts of burst edges edge_us apart, then idle_ms without any, from
+ * the time the device is opened.  The pin reads back what was written
+ * to it XOR the stimulus.  When the opener closes the device, the number
+ * of edges it was given is printed, to check an input monitor against.
+ */
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <fcntl.h>	/* fcntl() */
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>	/* arc4random_uniform(), strtol() */
+#include <string.h>	/* memset(), strlcpy() */
+#include <time.h>	/* clock_gettime() */
+#include <unistd.h>	/* close(), getopt(), read(), write() */
+
+#include "usbio.h"
+
+#define SIM_DEFAULT_DIR		"/tmp/usbiosim"
+#define SIM_DEFAULT_DEVS	8
+#define SIM_MAXMODELS		16
+#define SIM_QUEUE		64	/* pending replies per device */
+#define SIM_MAXBUSES		16
+#define SIM_BUS_SLOT		50	/* us, ~20 transactions a frame */
+
+/* latency model of a device, in ns */
+struct sim_model {
+	uint64_t	base;
+	uint64_t	jitter;		/* uniform, added to base */
+	struct usbio_profile *prof;	/* if not NULL, base/jitter unused */
+};
+
+/* per device state while fitting a trace */
+struct fit_dev {
+	uint64_t	sent[256];	/* by sequence number */
+	unsigned char	class[256];
+	char		pending[256];
+	int		outstanding;
+	uint64_t	last;		/* last activity */
+	uint64_t	reply;		/* last reply */
+	int		active;
+};
+
+#define FIT_FIRST	0
+#define FIT_RTT		1
+#define FIT_BURST	2
+#define FIT_DEFAULT_IDLE 1000	/* ms */
+
+struct sim_reply {
+	uint64_t	due;
+	unsigned char	buf[USBIO_REPORT_SIZE];
+};
+
+struct sim_dev {
+	int		lfd;		/* listening socket */
+	int		cfd;		/* connected opener, -1 if none */
+	struct usbio_simid id;
+	struct sim_model *model;
+	uint64_t	*bus;		/* bus busy until, NULL: no bus limit */
+	unsigned char	out[2];
+	uint64_t	busy;		/* device busy until */
+	int		used;		/* has served a request */
+	struct sim_reply q[SIM_QUEUE];
+	int		qhead, qlen;
+	uint64_t	requests, dropped;
+	uint64_t	stim0;		/* stimulus start, see -E */
+};
+
+/* global variables */
+volatile sig_atomic_t interrupted = 0;
+
+static struct sim_dev *sdevs;
+static int nsdevs = SIM_DEFAULT_DEVS;
+static struct sim_model models[SIM_MAXMODELS];
+static int nmodels = 0;
+static char simdir[256] = SIM_DEFAULT_DIR;
+static int busdevs[SIM_MAXBUSES];	/* devices per bus, -B */
+static int nbuses = 0;
+static uint64_t busbusy[SIM_MAXBUSES];
+static uint64_t busslot = SIM_BUS_SLOT * 1000ULL;
+static uint64_t stim_edge = 0, stim_idle = 0;	/* -E, ns */
+static uint64_t stim_burst = 0;
+
+/* prototypes */
+void	usage(void);
+
+static uint64_t
+sim_nsec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sighandler(int sig) {
+	interrupted = 1;
+}
+
+/*
+ * parse a latency model, "base_us[:jitter_us]" or a profile file
+ */
+static int
+sim_model_parse(const char *spec, struct sim_model *m) {
+	char *ep;
+	long v;
+
+	memset(m, 0, sizeof(*m));
+	if (access(spec, R_OK) == 0) {
+		m->prof = malloc(sizeof(*m->prof));
+		if (m->prof == NULL)
+			err(1, "malloc");
+		if (profile_load(spec, m->prof) == -1)
+			errx(1, "%s: bad profile", spec);
+		return 0;
+	}
+	v = strtol(spec, &ep, 10);
+	if (ep == spec || v < 0)
+		return -1;
+	m->base = v * 1000ULL;
+	if (*ep == ':') {
+		v = strtol(ep + 1, &ep, 10);
+		if (v < 0)
+			return -1;
+		m->jitter = v * 1000ULL;
+	}
+	return *ep == '\0' ? 0 : -1;
+}
+
+/*
+ * parse -B, "count,count,...[@slot_us]"
+ */
+static int
+sim_bus_parse(const char *spec) {
+	char *ep;
+	long v;
+
+	for (nbuses = 0; nbuses < SIM_MAXBUSES; ) {
+		v = strtol(spec, &ep, 10);
+		if (ep == spec || v < 1)
+			return -1;
+		busdevs[nbuses++] = v;
+		if (*ep != ',')
+			break;
+		spec = ep + 1;
+	}
+	if (*ep == '@') {
+		v = strtol(ep + 1, &ep, 10);
+		if (v < 1)
+			return -1;
+		busslot = v * 1000ULL;
+	}
+	return *ep == '\0' ? 0 : -1;
+}
+
+/*
+ * parse -E, "edge_us,burst,idle_ms"
+ */
+static int
+sim_stim_parse(const char *spec) {
+	char *ep;
+	long e, b, i;
+
+	e = strtol(spec, &ep, 10);
+	if (*ep != ',')
+		return -1;
+	b = strtol(ep + 1, &ep, 10);
+	if (*ep != ',')
+		return -1;
+	i = strtol(ep + 1, &ep, 10);
+	if (*ep != '\0' || e < 1 || b < 1 || i < 0)
+		return -1;
+	stim_edge = e * 1000ULL;
+	stim_burst = b;
+	stim_idle = i * 1000000ULL;
+	return 0;
+}
+
+/*
+ * the number of stimulus edges t ns after it started
+ */
+static uint64_t
+sim_stim_edges(uint64_t t) {
+	uint64_t cycle = stim_burst * stim_edge + stim_idle, ph;
+
+	if (stim_burst == 0)
+		return 0;
+	ph = t % cycle / stim_edge;
+	return t / cycle * stim_burst + (ph < stim_burst ? ph : stim_burst);
+}
+
+/*
+ * when will the reply of a request arriving now be sent?
+ */
+static uint64_t
+sim_due(struct sim_dev *sd, uint64_t now) {
+	struct sim_model *m = sd->model;
+	struct usbio_profile *p = m->prof;
+	uint64_t lat, due;
+
+	if (p == NULL) {
+		lat = m->base;
+		if (m->jitter != 0)
+			lat += arc4random_uniform((uint32_t)(m->jitter / 1000))
+				* 1000ULL;
+		due = (sd->busy > now ? sd->busy : now) + lat;
+	} else if (sd->busy > now)
+		due = sd->busy + profile_sample(p->burst, arc4random());
+	else if (!sd->used || now - sd->busy > p->idle)
+		due = now + profile_sample(p->first, arc4random());
+	else
+		due = now + profile_sample(p->rtt, arc4random());
+
+	/* the transaction waits for a slot on its bus */
+	if (sd->bus != NULL) {
+		if (*sd->bus + busslot > due)
+			due = *sd->bus + busslot;
+		*sd->bus = due;
+	}
+	return due;
+}
+
+/*
+ * create the listening socket of a device
+ */
+static void
+sim_listen(struct sim_dev *sd, int i) {
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/uhid%d",
+	    simdir, i) >= sizeof(sun.sun_path))
+		errx(1, "%s: path too long", simdir);
+	unlink(sun.sun_path);
+
+	sd->lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sd->lfd == -1)
+		err(1, "socket");
+	if (bind(sd->lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", sun.sun_path);
+	if (listen(sd->lfd, 1) == -1)
+		err(1, "listen");
+	sd->cfd = -1;
+}
+
+static void
+sim_accept(struct sim_dev *sd) {
+	int fd;
+
+	fd = accept(sd->lfd, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (sd->cfd != -1) {
+		close(fd);	/* busy, like a second open of uhid(4) */
+		return;
+	}
+	if (write(fd, &sd->id, sizeof(sd->id)) != sizeof(sd->id) ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		close(fd);
+		return;
+	}
+	sd->cfd = fd;	/* non-blocking: a slow opener stalls no other */
+	sd->qlen = 0;
+	sd->stim0 = sim_nsec();
+}
+
+/*
+ * take a request from the opener and queue its reply
+ */
+static void
+sim_request(struct sim_dev *sd, uint64_t now) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct sim_reply *r;
+	ssize_t len;
+	int i;
+
+	len = read(sd->cfd, buf, sizeof(buf));
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		if (stim_burst != 0)
+			fprintf(stderr, "uhid%d: %llu stimulus edges\n",
+				(int)(sd - sdevs), (unsigned long long)
+				sim_stim_edges(now - sd->stim0));
+		close(sd->cfd);
+		sd->cfd = -1;
+		return;
+	}
+	if (len != USBIO_REPORT_SIZE || buf[0] != USBIO2_RW)
+		return;
+	sd->requests++;
+
+	for (i = 1; i + 1 < USBIO_REPORT_SIZE - 1 && buf[i] != 0; i += 2) {
+		if (buf[i] == 1)
+			sd->out[0] = buf[i + 1];
+		else if (buf[i] == 2)
+			sd->out[1] = buf[i + 1] & USBIO_PORT2_MASK;
+	}
+
+	if (sd->qlen == SIM_QUEUE) {
+		sd->dropped++;	/* the opener does not read, drop */
+		return;
+	}
+	r = &sd->q[(sd->qhead + sd->qlen++) % SIM_QUEUE];
+	memset(r->buf, 0, sizeof(r->buf));
+	r->buf[0] = USBIO2_RW;
+	r->buf[USBIO_REPLY_PORT1] = sd->out[0] ^
+		(sim_stim_edges(now - sd->stim0) & 1);
+	r->buf[USBIO_REPLY_PORT2] = sd->out[1];
+	r->buf[USBIO_SEQNO] = buf[USBIO_SEQNO];
+
+	sd->busy = r->due = sim_due(sd, now);
+	sd->used = 1;
+}
+
+/*
+ * send replies which are due, return the next due time (0 if none)
+ */
+static uint64_t
+sim_reply(struct sim_dev *sd, uint64_t now) {
+	struct sim_reply *r;
+	ssize_t len;
+
+	while (sd->qlen > 0) {
+		r = &sd->q[sd->qhead];
+		if (r->due > now)
+			return r->due;
+		len = write(sd->cfd, r->buf, sizeof(r->buf));
+		if ((len == -1 && errno == EAGAIN) ||
+		    (len >= 0 && len != sizeof(r->buf)))
+			return now + 1000000;	/* opener is slow, retry */
+		sd->qhead = (sd->qhead + 1) % SIM_QUEUE;
+		sd->qlen--;
+	}
+	return 0;
+}
+
+static int
+fit_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+fit_deciles(uint64_t *v, size_t n, uint64_t *q) {
+	int i;
+
+	qsort(v, n, sizeof(*v), fit_cmp);
+	for (i = 0; i < USBIO_PROFILE_QUANTILES; i++)
+		q[i] = v[(n - 1) * i / (USBIO_PROFILE_QUANTILES - 1)];
+}
+
+/*
+ * fit a latency profile to a trace written by usbioctl -T,
+ * and print it on stdout
+ */
+static int
+sim_fit(const char *path, uint64_t idle) {
+	struct usbio_trace_rec rec;
+	struct usbio_profile prof;
+	struct fit_dev **fd, *f;
+	uint64_t *v[3], lat;
+	size_t n[3] = { 0, 0, 0 }, size[3] = { 0, 0, 0 };
+	unsigned char seq;
+	FILE *fp;
+	int c;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(1, "%s", path);
+	fd = calloc(65536, sizeof(*fd));
+	if (fd == NULL)
+		err(1, "calloc");
+	memset(v, 0, sizeof(v));
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		f = fd[rec.dev];
+		if (f == NULL) {
+			f = fd[rec.dev] = calloc(1, sizeof(*f));
+			if (f == NULL)
+				err(1, "calloc");
+		}
+		seq = rec.buf[USBIO_SEQNO];
+
+		if (rec.dir == USBIO_TRACE_WRITE) {
+			if (f->outstanding > 0)
+				f->class[seq] = FIT_BURST;
+			else if (!f->active || rec.t - f->last > idle)
+				f->class[seq] = FIT_FIRST;
+			else
+				f->class[seq] = FIT_RTT;
+			f->sent[seq] = rec.t;
+			f->pending[seq] = 1;
+			f->outstanding++;
+			f->active = 1;
+			f->last = rec.t;
+			continue;
+		}
+
+		if (rec.dir != USBIO_TRACE_READ || !f->pending[seq])
+			continue;
+		f->pending[seq] = 0;
+		f->outstanding--;
+		c = f->class[seq];
+		/* a queued request is served once the previous one is done */
+		if (c == FIT_BURST && f->reply > f->sent[seq])
+			lat = rec.t - f->reply;
+		else
+			lat = rec.t - f->sent[seq];
+		f->reply = f->last = rec.t;
+
+		if (n[c] == size[c]) {
+			size[c] = size[c] ? size[c] * 2 : 1024;
+			v[c] = reallocarray(v[c], size[c], sizeof(*v[c]));
+			if (v[c] == NULL)
+				err(1, "reallocarray");
+		}
+		v[c][n[c]++] = lat;
+	}
+	fclose(fp);
+
+	if (n[FIT_RTT] == 0) {
+		fprintf(stderr, "%s: no request with a reply\n", path);
+		return 1;
+	}
+	memset(&prof, 0, sizeof(prof));
+	prof.idle = idle;
+	fit_deciles(v[FIT_RTT], n[FIT_RTT], prof.rtt);
+	if (n[FIT_FIRST])
+		fit_deciles(v[FIT_FIRST], n[FIT_FIRST], prof.first);
+	else
+		memcpy(prof.first, prof.rtt, sizeof(prof.rtt));
+	if (n[FIT_BURST])
+		fit_deciles(v[FIT_BURST], n[FIT_BURST], prof.burst);
+	else
+		memcpy(prof.burst, prof.rtt, sizeof(prof.rtt));
+
+	printf("# fitted from %s: first %zu, rtt %zu, burst %zu samples\n",
+		path, n[FIT_FIRST], n[FIT_RTT], n[FIT_BURST]);
+	profile_print(stdout, &prof);
+	return 0;
+}
+
+static void
+sim_cleanup(void) {
+	char path[sizeof(simdir) + 16];
+	int i;
+
+	for (i = 0; i < nsdevs; i++) {
+		if (snprintf(path, sizeof(path), "%s/uhid%d", simdir, i) >=
+		    (int)sizeof(path))
+			continue;
+		unlink(path);
+	}
+}
+
+/*
+ * main
+ */
+int
+main(int argc, char *argv[]) {
+	struct pollfd *pfd;
+	struct rlimit rl;
+	struct sim_dev *sd;
+	struct timespec ts, *tsp;
+	uint64_t now, next, due;
+	int ch, i, n, b;
+	uint64_t idle = FIT_DEFAULT_IDLE * 1000000ULL;
+	const char *trace = NULL;
+
+	while ((ch = getopt(argc, argv, "B:d:E:F:i:l:n:")) != -1) {
+		switch (ch) {
+		case 'B':
+			if (sim_bus_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'd':
+			strlcpy(simdir, optarg, sizeof(simdir));
+			break;
+		case 'E':
+			if (sim_stim_parse(optarg) == -1)
+				usage();	/* not return */
+			break;
+		case 'F':
+			trace = optarg;
+			break;
+		case 'i':
+			idle = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'l':
+			if (nmodels == SIM_MAXMODELS ||
+			    sim_model_parse(optarg, &models[nmodels]) == -1)
+				usage();	/* not return */
+			nmodels++;
+			break;
+		case 'n':
+			nsdevs = atoi(optarg);
+			if (nsdevs < 1 || nsdevs > USBIO_MAXDEVS)
+				usage();	/* not return */
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();	/* not return */
+
+	if (trace != NULL)
+		exit(sim_fit(trace, idle));
+
+	if (nbuses > 0) {
+		for (nsdevs = 0, b = 0; b < nbuses; b++)
+			nsdevs += busdevs[b];
+		if (nsdevs > USBIO_MAXDEVS)
+			usage();	/* not return */
+	}
+
+	if (nmodels == 0) {
+		models[0].base = 1000000;	/* 1 ms, a full speed frame */
+		models[0].jitter = 250000;
+		nmodels = 1;
+	}
+
+	/* a listening and a connected socket per device */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)nsdevs * 2 + 16) {
+		rl.rlim_cur = (rlim_t)nsdevs * 2 + 16;
+		if (rl.rlim_cur > rl.rlim_max)
+			rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (mkdir(simdir, 0755) == -1 && errno != EEXIST)
+		err(1, "mkdir %s", simdir);
+
+	sdevs = calloc(nsdevs, sizeof(*sdevs));
+	pfd = calloc(nsdevs * 2, sizeof(*pfd));
+	if (sdevs == NULL || pfd == NULL)
+		err(1, "calloc");
+
+	for (i = 0, b = 0, n = 0; i < nsdevs; i++) {
+		sd = &sdevs[i];
+		sd->id.magic = USBIO_SIM_MAGIC;
+		sd->id.vendor = 0x1352;
+		/* alternate between the USB-IO 2.0 and 2.0(AKI) IDs */
+		sd->id.product = (i & 1) ? 0x0121 : 0x0120;
+		sd->id.release = 0x0100;
+		sd->id.bus = 1;
+		if (nbuses > 0) {
+			if (n == busdevs[b]) {
+				b++;
+				n = 0;
+			}
+			sd->id.bus = b + 1;
+			sd->bus = &busbusy[b];
+			n++;
+		}
+		sd->id.addr = (i % 127) + 1;
+		sd->id.port = (i % 4) + 1;
+		snprintf(sd->id.serial, sizeof(sd->id.serial), "SIM%05d", i);
+		sd->model = &models[i % nmodels];
+		sim_listen(sd, i);
+	}
+	fprintf(stderr, "%d devices in %s\n", nsdevs, simdir);
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	next = 0;
+	while (!interrupted) {
+		n = 0;
+		for (i = 0; i < nsdevs; i++) {
+			pfd[n].fd = sdevs[i].lfd;
+			pfd[n++].events = POLLIN;
+			pfd[n].fd = sdevs[i].cfd;	/* ignored if -1 */
+			pfd[n++].events = POLLIN;
+		}
+
+		tsp = NULL;
+		if (next != 0) {
+			now = sim_nsec();
+			due = next > now ? next - now : 0;
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			tsp = &ts;
+		}
+		if (ppoll(pfd, n, tsp, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		now = sim_nsec();
+		for (i = 0; i < nsdevs; i++) {
+			sd = &sdevs[i];
+			if (pfd[i * 2].revents & POLLIN)
+				sim_accept(sd);
+			if (sd->cfd != -1 &&
+			    (pfd[i * 2 + 1].revents & (POLLIN | POLLHUP)))
+				sim_request(sd, now);
+		}
+
+		next = 0;
+		for (i = 0; i < nsdevs; i++) {
+			sd = &sdevs[i];
+			if (sd->cfd == -1)
+				continue;
+			due = sim_reply(sd, now);
+			if (due != 0 && (next == 0 || due < next))
+				next = due;
+		}
+	}
+
+	sim_cleanup();
+	exit(0);
+}
+
+__dead void
+usage(void) {
+	fprintf(stderr, "Usage: %s [-B count,...[@slot_us]] [-d dir]"
+		" [-E edge_us,burst,idle_ms]\n"
+		"\t\t[-l latency_us[:jitter_us] ...] [-l profile ...]"
+		" [-n devices]\n", getprogname());
+	fprintf(stderr, "       %s -F trace [-i idle_ms]\n", getprogname());
+	fprintf(stderr, "\tDefault dir = %s\n", SIM_DEFAULT_DIR);
+	exit(2);
+}
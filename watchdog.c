@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * watchdog.c: outputs held by leases, reverted when a lease lapses
+ *
+ * A lease "[dev:]port=value[/mask]@interval_ms" asserts value on the
+ * pins of mask while its client keeps renewing it at least once per
+ * interval; when a whole interval passes without renewal, it ends.  A pin
+ * is on while any live lease of it asserts 1; a pin without live leases
+ * has the value it had when the watchdog started, so leases of one pin
+ * may overlap and end in any order.  At exit, every lease ends and the
+ * pins get back their starting values.  Leases come from the
+ * command line or, on the control socket (-S, see serve.c for -m ctl),
+ *	lease <spec>		the reply is the lease id
+ *	beat <id>		renew
+ *	release <id>		end the lease, reverting its pins
+ * A lease is also renewed by incrementing beat[id] in the file given by
+ * -W (struct usbio_wdshm), which costs a client no system call at all.
+ *
+ * Renewing only sets a flag or bumps a counter.  Leases sit in a hashed
+ * timer wheel of WD_SLOTS slots of WD_TICK_MS, and a tick only looks at
+ * the leases whose interval ends in it: one renewed since its last check
+ * is put back one interval ahead, one that is not is reverted.  The cost
+ * is per lease and interval, not per lease and tick, so thousands of
+ * leases cost next to nothing.  Pins revert within one interval and one
+ * tick after a missed renewal (two intervals after the last one, at
+ * most), plus the exchange with the device; reverts of a tick are
+ * written with one report per device.
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>	/* err() */
+#include <errno.h>
+#include <fcntl.h>	/* open() */
+#include <poll.h>	/* ppoll() */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>	/* atoi(), strtol() */
+#include <string.h>	/* memset(), strcmp() */
+#include <time.h>
+#include <unistd.h>	/* ftruncate(), geteuid(), unlink() */
+
+#include "usbio.h"
+
+#define WD_TICK_MS	10
+#define WD_TICK		(WD_TICK_MS * 1000000ULL)
+#define WD_SLOTS	256
+#define WD_MSGLEN	256
+
+struct wd_lease {
+	int		used;
+	int		dev;
+	int		port;		/* 0 or 1 */
+	unsigned char	val, mask;
+	int		renewed;	/* by a datagram */
+	uint32_t	seen;		/* beat[] at the last check */
+	uint32_t	interval;	/* in ticks */
+	uint32_t	rounds;		/* wheel turns left */
+	uint64_t	due;		/* in ns, for the statistics */
+	int		slot;
+	int		prev, next;	/* slot list, -1 terminated */
+};
+
+static struct wd_lease wd_leases[USBIO_WD_MAXLEASES];
+static int wd_free[USBIO_WD_MAXLEASES];	/* stack of free ids */
+static int wd_nfree = 0;
+static int wd_wheel[WD_SLOTS];
+static uint64_t wd_t0, wd_tick = 0;
+static struct usbio_wdshm *wd_shm = NULL;
+static char wd_dirty[USBIO_MAXDEVS];
+static int wd_dirtylist[USBIO_MAXDEVS], wd_ndirty = 0;
+static char wd_failing[USBIO_MAXDEVS];	/* its last write got no reply */
+static unsigned char wd_base[USBIO_MAXDEVS][2];	/* pins without leases */
+static uint16_t wd_held[USBIO_MAXDEVS][2][8];	/* live leases of a pin */
+static uint16_t wd_on[USBIO_MAXDEVS][2][8];	/* of them asserting 1 */
+
+/* statistics */
+static int wd_nleases = 0, wd_expired = 0, wd_checks = 0, wd_failed = 0;
+static uint64_t wd_late_max = 0;
+
+static void
+wd_link(int id, uint32_t ticks) {
+	struct wd_lease *l = &wd_leases[id];
+
+	/* a lease due WD_SLOTS ticks ahead is in the current slot */
+	l->rounds = (ticks - 1) / WD_SLOTS;
+	l->slot = (wd_tick + ticks) % WD_SLOTS;
+	l->due = wd_t0 + (wd_tick + ticks) * WD_TICK;
+	l->prev = -1;
+	l->next = wd_wheel[l->slot];
+	if (l->next != -1)
+		wd_leases[l->next].prev = id;
+	wd_wheel[l->slot] = id;
+}
+
+static void
+wd_unlink(int id) {
+	struct wd_lease *l = &wd_leases[id];
+
+	if (l->prev != -1)
+		wd_leases[l->prev].next = l->next;
+	else
+		wd_wheel[l->slot] = l->next;
+	if (l->next != -1)
+		wd_leases[l->next].prev = l->prev;
+}
+
+static void
+wd_set(int dev, int port, unsigned char val, unsigned char mask) {
+	devs[dev].out[port] = (devs[dev].out[port] & ~mask) | (val & mask);
+	if (!wd_dirty[dev]) {
+		wd_dirty[dev] = 1;
+		wd_dirtylist[wd_ndirty++] = dev;
+	}
+}
+
+/*
+ * write the devices changed since the last flush, one report each
+ *   a device whose reply does not come stays dirty, and is written
+ *   again at the next flush
+ */
+static void
+wd_flush(void) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	int i, d, n = 0;
+
+	for (i = 0; i < wd_ndirty; i++) {
+		d = wd_dirtylist[i];
+		usbio_frame2(buf, USBIO_PORT1 | USBIO_PORT2, devs[d].out[0],
+			devs[d].out[1]);
+		if (usbio_xfer2(devs[d].fd, buf) == -1) {
+			if (!wd_failing[d])
+				fprintf(stderr, "watchdog: %s: write not"
+					" acknowledged, retrying\n",
+					devs[d].path);
+			wd_failing[d] = 1;
+			wd_failed++;
+			wd_dirtylist[n++] = d;
+			continue;
+		}
+		wd_failing[d] = 0;
+		wd_dirty[d] = 0;
+	}
+	wd_ndirty = n;
+}
+
+/*
+ * add (n = 1) or remove (n = -1) the pins of a lease, and set them to
+ * what the live leases, or the base value, say
+ */
+static void
+wd_hold(const struct wd_lease *l, int n) {
+	unsigned char val = 0;
+	int bit;
+
+	for (bit = 0; bit < 8; bit++) {
+		if ((l->mask & (1 << bit)) == 0)
+			continue;
+		wd_held[l->dev][l->port][bit] += n;
+		if (l->val & (1 << bit))
+			wd_on[l->dev][l->port][bit] += n;
+		if (wd_held[l->dev][l->port][bit] == 0)
+			val |= wd_base[l->dev][l->port] & (1 << bit);
+		else if (wd_on[l->dev][l->port][bit] > 0)
+			val |= 1 << bit;
+	}
+	wd_set(l->dev, l->port, val, l->mask);
+}
+
+static void
+wd_revert(int id) {
+	struct wd_lease *l = &wd_leases[id];
+
+	wd_hold(l, -1);
+	l->used = 0;
+	wd_free[wd_nfree++] = id;
+}
+
+/*
+ * start a lease, return its id or -1
+ */
+static int
+wd_lease(const char *spec) {
+	struct wd_lease *l;
+	char *ep;
+	long dev = 0, port, val, mask = 0xff, ms;
+	int id;
+
+	port = strtol(spec, &ep, 10);
+	if (*ep == ':') {
+		dev = port;
+		port = strtol(ep + 1, &ep, 10);
+	}
+	if (*ep != '=')
+		return -1;
+	val = strtol(ep + 1, &ep, 16);
+	if (*ep == '/')
+		mask = strtol(ep + 1, &ep, 16);
+	if (*ep != '@')
+		return -1;
+	ms = strtol(ep + 1, &ep, 10);
+	if (*ep != '\0' || dev < 0 || dev >= ndevs || (port != 1 &&
+	    port != 2) || val < 0 || val > 0xff || mask < 0 || mask > 0xff ||
+	    ms < WD_TICK_MS || wd_nfree == 0)
+		return -1;
+
+	id = wd_free[--wd_nfree];
+	l = &wd_leases[id];
+	memset(l, 0, sizeof(*l));
+	l->used = 1;
+	l->dev = dev;
+	l->port = port - 1;
+	l->mask = mask & (port == 2 ? USBIO_PORT2_MASK : 0xff);
+	l->val = val;
+	l->interval = (ms + WD_TICK_MS - 1) / WD_TICK_MS;
+	if (wd_shm != NULL)
+		l->seen = wd_shm->beat[id];
+	wd_hold(l, 1);
+	wd_link(id, l->interval);
+	wd_nleases++;
+	return id;
+}
+
+/*
+ * one tick of the wheel
+ */
+static void
+wd_run(uint64_t now) {
+	struct wd_lease *l;
+	uint32_t beat;
+	int id, next;
+
+	for (id = wd_wheel[wd_tick % WD_SLOTS]; id != -1; id = next) {
+		l = &wd_leases[id];
+		next = l->next;
+		if (l->rounds > 0) {
+			l->rounds--;
+			continue;
+		}
+		wd_checks++;
+		wd_unlink(id);
+		beat = wd_shm != NULL ? wd_shm->beat[id] : l->seen;
+		if (l->renewed || beat != l->seen) {
+			l->renewed = 0;
+			l->seen = beat;
+			wd_link(id, l->interval);
+			continue;
+		}
+		if (now - l->due > wd_late_max)
+			wd_late_max = now - l->due;
+		DPRINTF("lease %d: expired\n", id);
+		wd_revert(id);
+		wd_expired++;
+	}
+}
+
+static struct wd_lease *
+wd_find(const char *s) {
+	int id = atoi(s);
+
+	if (id < 0 || id >= USBIO_WD_MAXLEASES || !wd_leases[id].used)
+		return NULL;
+	return &wd_leases[id];
+}
+
+static int
+wd_command(char *cmd, char *reply) {
+	struct wd_lease *l;
+	char *op, *arg, *last;
+	int id;
+
+	op = strtok_r(cmd, " \t\n", &last);
+	arg = strtok_r(NULL, " \t\n", &last);
+	if (op == NULL || arg == NULL)
+		return snprintf(reply, WD_MSGLEN, "error bad command");
+
+	if (strcmp(op, "beat") == 0) {
+		if ((l = wd_find(arg)) == NULL)
+			return snprintf(reply, WD_MSGLEN, "error no lease %s",
+				arg);
+		l->renewed = 1;
+		return snprintf(reply, WD_MSGLEN, "ok");
+	}
+	if (strcmp(op, "lease") == 0) {
+		if ((id = wd_lease(arg)) == -1)
+			return snprintf(reply, WD_MSGLEN, "error %s", arg);
+		return snprintf(reply, WD_MSGLEN, "ok %d", id);
+	}
+	if (strcmp(op, "release") == 0) {
+		if ((l = wd_find(arg)) == NULL)
+			return snprintf(reply, WD_MSGLEN, "error no lease %s",
+				arg);
+		id = l - wd_leases;
+		wd_unlink(id);
+		wd_revert(id);
+		return snprintf(reply, WD_MSGLEN, "ok");
+	}
+	return snprintf(reply, WD_MSGLEN, "error bad command %s", op);
+}
+
+/*
+ * map the heartbeat counters
+ *   whoever can write the file can hold the leases, so it is made
+ *   private; an existing one must be ours and not writable by others,
+ *   and is reused as it is: a lease starts from the count it finds
+ */
+static void
+wd_map(const char *path) {
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+	if (fd == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+		errx(1, "%s: not a private file of ours", path);
+	if (ftruncate(fd, sizeof(*wd_shm)) == -1)
+		err(1, "%s", path);
+	wd_shm = mmap(NULL, sizeof(*wd_shm), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (wd_shm == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	wd_shm->magic = USBIO_WD_MAGIC;
+	wd_shm->nleases = USBIO_WD_MAXLEASES;
+}
+
+/*
+ * watchdog mode
+ *   argv: leases held from the start
+ */
+int
+watchdog_main(int fd, int argc, char *argv[]) {
+	unsigned char buf[USBIO_REPORT_SIZE];
+	struct sockaddr_un from;
+	struct pollfd pfd;
+	struct timespec ts;
+	struct rusage ru;
+	socklen_t fromlen;
+	char cmd[WD_MSGLEN], reply[WD_MSGLEN];
+	uint64_t now, next;
+	ssize_t len;
+	int d, i, n, ret;
+
+	if (opts.ctlsock == NULL && opts.wdshm == NULL)
+		errx(1, "watchdog: leases are renewed through -S or -W");
+
+	for (i = 0; i < WD_SLOTS; i++)
+		wd_wheel[i] = -1;
+	for (i = USBIO_WD_MAXLEASES - 1; i >= 0; i--)
+		wd_free[wd_nfree++] = i;
+	for (d = 0; d < ndevs; d++) {
+		usbio_frame2(buf, 0, 0, 0);
+		if (usbio_xfer2(devs[d].fd, buf) == -1)
+			errx(1, "watchdog: %s: no reply", devs[d].path);
+		devs[d].out[0] = buf[USBIO_REPLY_PORT1];
+		devs[d].out[1] = buf[USBIO_REPLY_PORT2] & USBIO_PORT2_MASK;
+		devs[d].known = 1;
+		wd_base[d][0] = devs[d].out[0];
+		wd_base[d][1] = devs[d].out[1];
+	}
+	if (opts.wdshm != NULL)
+		wd_map(opts.wdshm);
+	wd_t0 = usbio_nsec();
+
+	for (i = 0; i < argc; i++) {
+		if ((ret = wd_lease(argv[i])) == -1)
+			errx(1, "watchdog: bad lease %s", argv[i]);
+		printf("lease %d: %s\n", ret, argv[i]);
+	}
+	wd_flush();
+
+	pfd.fd = -1;
+	if (opts.ctlsock != NULL)
+		pfd.fd = serve_socket(opts.ctlsock);
+	pfd.events = POLLIN;
+	printf("watchdog: %d devices, tick %d ms\n", ndevs, WD_TICK_MS);
+	fflush(stdout);
+
+	while (!interrupted) {
+		next = wd_t0 + (wd_tick + 1) * WD_TICK;
+		now = usbio_nsec();
+		if (next > now) {
+			ts.tv_sec = (next - now) / 1000000000;
+			ts.tv_nsec = (next - now) % 1000000000;
+			ret = ppoll(&pfd, 1, &ts, NULL);
+			if (ret == -1 && errno != EINTR)
+				err(1, "ppoll");
+		}
+
+		/* all pending commands, then the ticks that have passed */
+		while (pfd.fd != -1) {
+			fromlen = sizeof(from);
+			len = recvfrom(pfd.fd, cmd, sizeof(cmd) - 1,
+				MSG_DONTWAIT, (struct sockaddr *)&from,
+				&fromlen);
+			if (len == -1)
+				break;
+			cmd[len] = '\0';
+			n = wd_command(cmd, reply);
+			if (fromlen > sizeof(sa_family_t))
+				sendto(pfd.fd, reply, n < WD_MSGLEN ? n :
+					WD_MSGLEN - 1, 0,
+					(struct sockaddr *)&from, fromlen);
+		}
+		now = usbio_nsec();
+		while (wd_t0 + (wd_tick + 1) * WD_TICK <= now) {
+			wd_tick++;
+			wd_run(now);
+		}
+		wd_flush();
+	}
+
+	/* no deadman is left, so no lease outlives the process */
+	for (i = 0; i < USBIO_WD_MAXLEASES; i++)
+		if (wd_leases[i].used) {
+			wd_unlink(i);
+			wd_revert(i);
+		}
+	wd_flush();
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%d leases, %d expired, %d checks in %.1f s, max revert"
+		" lateness %.3f ms, cpu %.3f s\n", wd_nleases, wd_expired,
+		wd_checks, (usbio_nsec() - wd_t0) / 1e9, wd_late_max / 1e6,
+		ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+	if (wd_failed > 0)
+		printf("%d writes not acknowledged\n", wd_failed);
+	if (pfd.fd != -1) {
+		close(pfd.fd);
+		unlink(opts.ctlsock);
+	}
+	return 0;
+}
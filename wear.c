@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2020 Kenji Aoyama <aoyama@nk-home.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * wear.c: output transition counters, for relay wear
+ *
+ * With -R file, every report usbio_send2() writes is compared with the
+ * last value written to the device: old ^ new is the set of output pins
+ * switching, and it is added to a bit-sliced counter (as in count.c), a
+ * few word operations per write however many pins switch.  Every
+ * WEAR_FLUSH, and at exit, the counters of a device are added into its
+ * entry of the store, a file mapped shared and found by the serial number
+ * (or path) of the device, so the counts and the last value written
+ * survive across runs and renumbering of uhid nodes.  Processes sharing a
+ * store add entries under flock(2), the store stays open for it.
+ *
+ * The state is per device, so threads writing to different devices (plan,
+ * fanout) do not share any.  -m wear prints the store, with the share of
+ * the rated cycles (-n) used by the most worn pin of each device.
+ */
+
+#include <sys/file.h>	/* flock() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>	/* err() */
+#include <fcntl.h>	/* open() */
+#include <stdio.h>
+#include <stdlib.h>	/* atexit() */
+#include <string.h>	/* memset(), strcmp(), strlcpy() */
+#include <unistd.h>	/* ftruncate() */
+
+#include "usbio.h"
+
+#define WEAR_PLANES	32
+#define WEAR_FLUSH	1000000000ULL	/* ns */
+#define WEAR_MAXFD	4096
+
+struct wear_dev {
+	struct usbio_wear_ent *ent;
+	uint16_t	plane[WEAR_PLANES];	/* toggles since the flush */
+	uint64_t	writes;
+	uint64_t	flushed;		/* time of the last flush */
+	uint64_t	run[USBIO_WEAR_PINS];	/* toggles in this run */
+};
+
+static struct usbio_wear *wear = NULL;
+static int wear_fd = -1;		/* of the store, for flock() */
+static struct wear_dev wear_devs[USBIO_MAXDEVS];
+static struct wear_dev *wear_byfd[WEAR_MAXFD];
+
+/* prototypes */
+static void	wear_exit(void);
+
+/*
+ * the key of a device in the store, it always fits: see usbio_wear_ent
+ */
+static const char *
+wear_key(struct usbio_dev *ud) {
+	return ud->serial[0] != '\0' ? ud->serial : ud->path;
+}
+
+static struct usbio_wear *
+wear_map(const char *path, int create) {
+	struct usbio_wear *w;
+	struct stat st;
+	int fd;
+
+	fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if (st.st_size == 0 && create) {
+		if (ftruncate(fd, sizeof(*w)) == -1)
+			err(1, "%s", path);
+	} else if (st.st_size != sizeof(*w))
+		errx(1, "%s: not a wear store", path);
+	w = mmap(NULL, sizeof(*w), create ? PROT_READ | PROT_WRITE :
+		PROT_READ, MAP_SHARED, fd, 0);
+	if (w == MAP_FAILED)
+		err(1, "mmap");
+	if (create)
+		wear_fd = fd;
+	else
+		close(fd);
+	if (w->magic == 0 && create)
+		w->magic = USBIO_WEAR_MAGIC;
+	if (w->magic != USBIO_WEAR_MAGIC)
+		errx(1, "%s: not a wear store", path);
+	return w;
+}
+
+/*
+ * count the writes to device d, from its current file descriptor
+ */
+void
+wear_attach(int d) {
+	struct usbio_dev *ud = &devs[d];
+	struct wear_dev *wd = &wear_devs[d];
+	struct usbio_wear_ent *e;
+	const char *key = wear_key(ud);
+	int i;
+
+	if (wear == NULL || ud->fd < 0 || ud->fd >= WEAR_MAXFD)
+		return;
+	if (wd->ent == NULL) {
+		/* another process may be adding an entry */
+		if (flock(wear_fd, LOCK_EX) == -1)
+			err(1, "flock");
+		for (i = 0; i < wear->nents; i++)
+			if (strcmp(wear->ent[i].key, key) == 0)
+				break;
+		if (i == USBIO_MAXDEVS)
+			errx(1, "wear store full");
+		e = &wear->ent[i];
+		if (i == wear->nents) {
+			strlcpy(e->key, key, sizeof(e->key));
+			e->vendor = ud->vendor;
+			e->product = ud->product;
+			wear->nents++;
+		}
+		flock(wear_fd, LOCK_UN);
+		wd->ent = e;
+		wd->flushed = usbio_nsec();
+	}
+	wear_byfd[ud->fd] = wd;
+}
+
+/*
+ * open the store, for the devices opened
+ */
+void
+wear_open(const char *path) {
+	int d;
+
+	wear = wear_map(path, 1);
+	for (d = 0; d < ndevs; d++)
+		wear_attach(d);
+	atexit(wear_exit);
+}
+
+static void
+wear_flush(struct wear_dev *wd, uint64_t now) {
+	uint32_t n;
+	int pin, k;
+
+	for (pin = 0; pin < USBIO_WEAR_PINS; pin++) {
+		for (n = 0, k = 0; k < WEAR_PLANES; k++)
+			n |= (uint32_t)((wd->plane[k] >> pin) & 1) << k;
+		wd->ent->toggles[pin] += n;
+		wd->run[pin] += n;
+	}
+	memset(wd->plane, 0, sizeof(wd->plane));
+	wd->ent->writes += wd->writes;
+	wd->writes = 0;
+	wd->flushed = now;
+	msync(wear, sizeof(*wear), MS_ASYNC);
+}
+
+/*
+ * a report is written to fd, called by usbio_send2()
+ */
+void
+wear_write(int fd, const unsigned char *buf) {
+	struct wear_dev *wd;
+	struct usbio_wear_ent *e;
+	uint16_t old, new, carry, toggle;
+	uint64_t now;
+	int i, k;
+
+	if (wear == NULL || fd < 0 || fd >= WEAR_MAXFD ||
+	    (wd = wear_byfd[fd]) == NULL || buf[1] == 0)
+		return;
+	e = wd->ent;
+	old = new = e->out[0] | e->out[1] << 8;
+	for (i = 1; i + 1 < USBIO_SEQNO && buf[i] != 0; i += 2) {
+		if (buf[i] == 1)
+			new = (new & 0xff00) | buf[i + 1];
+		else if (buf[i] == 2)
+			new = (new & 0x00ff) |
+				(buf[i + 1] & USBIO_PORT2_MASK) << 8;
+	}
+	toggle = e->known ? old ^ new : 0;
+	e->out[0] = new & 0xff;
+	e->out[1] = new >> 8;
+	e->known = 1;
+	wd->writes++;
+
+	/* add one to the count of every pin in toggle */
+	for (k = 0; toggle != 0 && k < WEAR_PLANES; k++) {
+		carry = wd->plane[k] & toggle;
+		wd->plane[k] ^= toggle;
+		toggle = carry;
+	}
+	if ((now = usbio_nsec()) - wd->flushed >= WEAR_FLUSH)
+		wear_flush(wd, now);
+}
+
+static void
+wear_exit(void) {
+	struct wear_dev *wd;
+	uint64_t now = usbio_nsec(), n, max;
+	int d, pin, p;
+
+	for (d = 0; d < ndevs; d++) {
+		wd = &wear_devs[d];
+		if (wd->ent == NULL)
+			continue;
+		wear_flush(wd, now);
+		for (n = 0, max = 0, p = 0, pin = 0; pin < USBIO_WEAR_PINS;
+		    pin++) {
+			n += wd->run[pin];
+			if (wd->run[pin] > max) {
+				max = wd->run[pin];
+				p = pin;
+			}
+		}
+		if (n > 0)
+			fprintf(stderr, "wear: dev %d (%s): %llu toggles,"
+				" most on pin %d.%d (%llu), %llu in total\n",
+				d, wd->ent->key, (unsigned long long)n,
+				p < 8 ? 1 : 2, p % 8, (unsigned long long)max,
+				(unsigned long long)wd->ent->toggles[p]);
+	}
+	msync(wear, sizeof(*wear), MS_SYNC);
+}
+
+/*
+ * wear mode
+ *   opts.count: rated cycles of the relays, if given
+ */
+int
+wear_main(int fd, int argc, char *argv[]) {
+	struct usbio_wear *w;
+	struct usbio_wear_ent *e;
+	uint64_t max;
+	int i, pin;
+
+	if (opts.wear == NULL)
+		errx(1, "wear: no store given (-R)");
+	w = wear_map(opts.wear, 0);
+	printf("%-16s %10s", "device", "writes");
+	for (pin = 0; pin < USBIO_WEAR_PINS; pin++)
+		printf(" %8s%d.%d", "", pin < 8 ? 1 : 2, pin % 8);
+	printf("%s\n", opts.count > 0 ? "   life" : "");
+	for (i = 0; i < w->nents; i++) {
+		e = &w->ent[i];
+		printf("%-16s %10llu", e->key,
+			(unsigned long long)e->writes);
+		for (max = 0, pin = 0; pin < USBIO_WEAR_PINS; pin++) {
+			printf(" %11llu",
+				(unsigned long long)e->toggles[pin]);
+			if (e->toggles[pin] > max)
+				max = e->toggles[pin];
+		}
+		if (opts.count > 0)
+			printf(" %5.1f%%", 100.0 * max / opts.count);
+		printf("\n");
+	}
+	munmap(w, sizeof(*w));
+	return 0;
+}